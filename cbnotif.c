@@ -9,6 +9,20 @@
 #include <linux/cdev.h>
 #include <linux/device.h>
 #include <linux/slab.h>
+#include <linux/uaccess.h>
+#include <linux/file.h>
+#include <linux/splice.h>
+#include <linux/mm.h>
+#include <linux/vmalloc.h>
+#include <linux/sort.h>
+#include <linux/poll.h>
+#include <linux/wait.h>
+#include <linux/namei.h>
+#include <linux/fiemap.h>
+#include <linux/rculist.h>
+#include <linux/srcu.h>
+#include <linux/hash.h>
+#include <linux/idr.h>
 #include "cbnotif.h"
 // TODO: hook inode_operation.trucate
 
@@ -19,11 +33,26 @@
 #define CBNOTIF_DEV_NUM 0
 #define DEV_NUM_RANGE 1
 #define MAX_REQUEST_SIZE PAGE_SIZE
+#define MAX_HEAT_BLOCKS (1 << 20) /* blocks beyond are not heat tracked */
+#define HEAT_CHUNK 256 /* blocks in a chunk of heat counters */
+#define HEAT_CHUNKS (MAX_HEAT_BLOCKS / HEAT_CHUNK)
+#define CQ_SIZE 256 /* completions a process can have unreaped */
+#define FIEMAP_BATCH 32 /* extents mapped by one call of ->fiemap */
+#define MI_HASH_BITS 8 /* log2 of buckets of monitored inodes */
+
+struct cbnotif_monitoring_process;
+struct cbnotif_monitored_inode;
+struct cbnotif_hooked_fops;
+struct cbnotif_heat_chunk;
+struct cbnotif_dirty_block;
+
 // implementation of character device for interface with process
 static int open_device(struct inode *, struct file *);
 static int release_device(struct inode *, struct file *);
 static ssize_t read_device(struct file *, char *, size_t, loff_t *);
 static ssize_t write_device(struct file *, const char *, size_t, loff_t *);
+static long ioctl_device(struct file *, unsigned int, unsigned long);
+static unsigned int poll_device(struct file *, poll_table *);
 
 // hooking inode operations
 static ssize_t write_inode(struct file *, const char __user *, size_t, loff_t *);
@@ -31,8 +60,48 @@ static ssize_t aio_write_inode(struct kiocb *, const struct iovec *, unsigned lo
 static ssize_t sendpage_inode(struct file *, struct page *, int, size_t, loff_t *, int);
 static ssize_t splice_write_inode(struct pipe_inode_info *, struct file *, loff_t *, size_t, unsigned int);  
 
-static struct cbnotif_monitored_inode * get_mi_by_file(struct file *);
-//static int cbnotif_find_inode(const char __user *, struct path *, unsigned);
+static struct cbnotif_monitored_inode * get_mi_by_id(struct cbnotif_monitoring_process *, int);
+static struct cbnotif_monitored_inode * find_mi(struct cbnotif_monitoring_process *, int);
+static struct cbnotif_hooked_fops * hook_fops(struct file_operations *);
+static void unhook_fops(struct cbnotif_hooked_fops *);
+static int get_orig_fops(const struct file_operations *, struct cbnotif_hooked_fops *);
+static void free_mi(struct cbnotif_monitored_inode *);
+static long monitor_cmd(struct cbnotif_monitoring_process *, void __user *, int);
+static long forget_cmd(struct cbnotif_monitoring_process *, int);
+static long changed_blocks_cmd(struct cbnotif_monitoring_process *, struct cbn_changed_blocks __user *);
+static long changed_extents_cmd(struct cbnotif_monitoring_process *, struct cbn_changed_extents __user *);
+static int map_dirty_extents(struct inode *, int, struct list_head *, loff_t *,
+                             struct cbn_extent *, int, struct fiemap_extent *);
+static int add_extent(struct cbn_extent *, int, int, loff_t, loff_t, loff_t, int);
+static long hot_extents_cmd(struct cbnotif_monitoring_process *, struct cbn_heat __user *);
+static void heat_record(struct cbnotif_monitored_inode *, loff_t, size_t);
+static int add_hot_extent(struct cbn_hot_extent *, int, int, const struct cbn_hot_extent *);
+static void heat_decay(struct cbnotif_heat_chunk *, unsigned long);
+static unsigned long heat_epoch(struct cbnotif_monitored_inode *);
+static void free_heat(struct cbnotif_monitored_inode *);
+static int heat_bucket(int);
+static void mark_dirty(struct cbnotif_monitored_inode *, loff_t, size_t);
+static int add_range(struct list_head *, int, int);
+static void count_dblocks(struct cbnotif_monitored_inode *, int);
+static int count_blocks(const int *, int);
+static int restore_blocks(struct list_head *, const int *, int);
+static void track_write(struct cbnotif_monitored_inode *, loff_t, size_t);
+static void append_flush(struct cbnotif_monitored_inode *);
+static int dirty_count(struct cbnotif_monitored_inode *);
+static void free_dblocks(struct list_head *);
+static int encode_dblocks(struct list_head *, int *, int);
+static long cut_cmd(struct cbnotif_monitoring_process *, struct cbn_cut __user *);
+static long frozen_blocks_cmd(struct cbnotif_monitoring_process *, struct cbn_frozen_blocks __user *);
+static long submit_cmd(struct cbnotif_monitoring_process *, struct cbn_submit __user *);
+static long reap_cmd(struct cbnotif_monitoring_process *, struct cbn_reap __user *);
+static void check_query(struct cbnotif_monitored_inode *);
+static void recheck_queries(struct cbnotif_monitoring_process *);
+static void account_write(struct file *, loff_t, size_t);
+static long stream_blocks_cmd(struct cbnotif_monitoring_process *, struct cbn_stream __user *);
+static int stream_write(struct file *, const char *, size_t);
+static int stream_range(int, loff_t, struct cbnotif_dirty_block *,
+                        struct file *, struct file *);
+static int cbnotif_find_inode(const char __user *, struct path *, unsigned);
 /**
  * serving process.
  */
@@ -40,14 +109,48 @@ struct cbnotif_monitoring_process {
   struct list_head   next_process;
   struct mutex       mp_mutex;   /** sync threads of the process */
   long               pid;
+  int                users;      /* open files of the device; synced by mp_list_mutex */
   struct list_head   monitored_inodes;
+  struct idr         mi_idr;     /* monitored inodes by id; synced by mp_mutex */
+  int                next_id;    /* lowest id for the next monitored file; ids aren't reused */
+  /**
+   *  Ring of completed queries. It's filled by writers of monitored
+   *  files holding mi_mutex, so it has own spin lock.
+   */
+  spinlock_t         cq_lock;
+  struct mutex       cq_mutex;   /* serializes reapers */
+  wait_queue_head_t  cq_wait;
+  unsigned int       cq_head;  /* next to reap */
+  unsigned int       cq_tail;  /* next to fill */
+  int                cq_overflowed; /* a query wasn't completed because the ring was full */
+  struct cbn_completion cq[CQ_SIZE];
 };
  
+/**
+ * file operations shared by monitored inodes (usually of one filesystem type).
+ * Original handlers are saved when the entry is created and never change.
+ * Entries are read under RCU and kept until the module is unloaded,
+ * so late callers of a hook still find the original handlers.
+ */
+struct cbnotif_hooked_fops {
+  struct list_head   next;
+  struct file_operations * fops;
+  int                users;   /* monitored inodes using the table */
+  /** original handlers */
+  ssize_t (*orig_write) (struct file *, const char __user *, size_t, loff_t *);
+  ssize_t (*orig_aio_write) (struct kiocb *, const struct iovec *, unsigned long, loff_t);
+  ssize_t (*orig_sendpage) (struct file *, struct page *, int, size_t, loff_t *, int);
+  ssize_t (*orig_splice_write)(struct pipe_inode_info *, struct file *, loff_t *, size_t, unsigned int);
+};
+
 /**
  * a file monitored by a process
  */
 struct cbnotif_monitored_inode {
   struct list_head   next_inode;
+  struct hlist_node  hash_node; // in mi_hash; synced by mp_list_mutex
+  int                id;     // returned by CBN_MONITOR
+  struct cbnotif_monitoring_process * mp; // owner
   struct inode *     inode;  // inode of monitored file
   struct mutex       mi_mutex; // modification the file from multiple processes
   /**
@@ -56,16 +159,50 @@ struct cbnotif_monitored_inode {
    */
   int                block_size;
   int                num_dblocks;  /* number dirty blocks; if -1 then overflow */
+  int                flags;        /* CBN_MONITOR_* */
+  /**
+   * Write counters of blocks if CBN_MONITOR_HEAT.
+   * HEAT_CHUNKS pointers; a chunk is allocated at the first write into it.
+   */
+  struct cbnotif_heat_chunk ** heat;
+  unsigned long      heat_stamp;   /* jiffies the current heat epoch started at */
+  unsigned long      heat_epochs;  /* heat epochs passed; never decreases */
   /**
    *  List dirty blocks about the monitoring process doesn't know yet.
    *  This list is cleaned after each monitoring process requies
    */   
   struct list_head   dblocks;
-  /** original handlers */
-  ssize_t (*orig_write) (struct file *, const char __user *, size_t, loff_t *);
-  ssize_t (*orig_aio_write) (struct kiocb *, const struct iovec *, unsigned long, loff_t);
-  ssize_t (*orig_sendpage) (struct file *, struct page *, int, size_t, loff_t *, int);
-  ssize_t (*orig_splice_write)(struct pipe_inode_info *, struct file *, loff_t *, size_t, unsigned int);  
+  /**
+   *  Dirty bytes before this offset are already reported by
+   *  CBN_CHANGED_EXTENTS. 0 if nothing is reported partially.
+   */
+  loff_t             extent_resume;
+  /**
+   *  Dirty blocks detached by CBN_CUT. Writers don't touch it.
+   *  The list is drained by CBN_FROZEN_BLOCKS.
+   */
+  struct list_head   frozen;
+  /**
+   *  Open-ended range of a sequential append stream (logs, WALs).
+   *  While writes come at append_next it grows without touching dblocks.
+   *  It's moved to dblocks when the pattern breaks or blocks are reported.
+   */
+  int                append_active;
+  loff_t             append_start;
+  loff_t             append_next;
+  /** the query submitted by CBN_SUBMIT */
+  int                query_armed;
+  int                query_threshold;
+  long long          query_cookie;
+  struct cbnotif_hooked_fops * hf; // file operations of the inode
+};
+
+/**
+ * write counters of HEAT_CHUNK adjacent blocks
+ */
+struct cbnotif_heat_chunk {
+  unsigned long      epoch;   /* heat epoch the counters are decayed to */
+  unsigned char      heat[HEAT_CHUNK];
 };
 
 /**
@@ -80,28 +217,47 @@ struct cbnotif_dirty_block {
 //  module vars 
 static struct mutex mp_list_mutex; /* sync mp_list structure modification */
 static struct list_head mp_list;   /* list of cbnotif_monitoring_process */
+static struct list_head hooked_fops; /* list of cbnotif_hooked_fops; synced by mp_list_mutex */
+/**
+ * Monitored inodes of all processes by inode, so the write hooks find them
+ * without mp_list_mutex. Writers walk a bucket under mi_srcu
+ * because they sleep on mi_mutex.
+ */
+static struct hlist_head mi_hash[1 << MI_HASH_BITS];
+static struct srcu_struct mi_srcu;
 static dev_t dev_num_region;
 static struct cdev  module_dev;
 static struct class * dev_class;
+static unsigned int heat_half_life = 60;
+module_param(heat_half_life, uint, 0644);
+MODULE_PARM_DESC(heat_half_life, "seconds after which write heat of blocks is halved");
 /**
  */
 static struct file_operations mod_dev_ops = {
   .read = read_device,
   .write = write_device,
+  .unlocked_ioctl = ioctl_device,
+  .poll = poll_device,
   .open = open_device,
   .release = release_device
 };
 
 static int __init cbnotif_init(void) {
-  int r;
+  int r, i;
   printk(KERN_INFO MOD_NAME ": start init\n");
   mutex_init(&mp_list_mutex);
   INIT_LIST_HEAD(&mp_list);
+  INIT_LIST_HEAD(&hooked_fops);
+  for (i = 0; i < (1 << MI_HASH_BITS); ++i)
+    INIT_HLIST_HEAD(&mi_hash[i]);
+  r = init_srcu_struct(&mi_srcu);
+  if (r < 0)
+    goto err;
 
   r = alloc_chrdev_region(&dev_num_region, CBNOTIF_DEV_NUM, DEV_NUM_RANGE, "cbnotifier");
   if (r < 0) {
     printk(KERN_ALERT MOD_NAME ": alloc_chrdev_region = %d\n", r);
-    goto err;
+    goto srcu;
   }
   dev_class = class_create(THIS_MODULE, "chardrv");
   if (!dev_class) {
@@ -127,16 +283,24 @@ static int __init cbnotif_init(void) {
   class_destroy(dev_class);
  class:
   unregister_chrdev_region(dev_num_region, DEV_NUM_RANGE);  
+ srcu:
+  cleanup_srcu_struct(&mi_srcu);
  err:  
   return r;
 }
 
 static void __exit cbnotif_cleanup(void) {
+  struct list_head * hf, * tmp;
   printk(KERN_INFO MOD_NAME ": cleanup start\n");
   cdev_del(&module_dev);
   device_destroy(dev_class, dev_num_region);
   class_destroy(dev_class);
   unregister_chrdev_region(dev_num_region, DEV_NUM_RANGE);
+  // all tables are unhooked; wait for hooks still reading the list
+  synchronize_rcu();
+  list_for_each_safe(hf, tmp, &hooked_fops)
+    kfree(hf);
+  cleanup_srcu_struct(&mi_srcu);
   printk(KERN_INFO MOD_NAME ": cleanup end\n");  
 }
 
@@ -168,75 +332,66 @@ static int open_device(struct inode * inode, struct file * file) {
     }
     mutex_init(&_mp->mp_mutex);
     _mp->pid = pid;
+    _mp->users = 1;
     INIT_LIST_HEAD(&_mp->next_process);
+    INIT_LIST_HEAD(&_mp->monitored_inodes);
+    idr_init(&_mp->mi_idr);
+    _mp->next_id = 0;
+    spin_lock_init(&_mp->cq_lock);
+    mutex_init(&_mp->cq_mutex);
+    init_waitqueue_head(&_mp->cq_wait);
+    _mp->cq_head = _mp->cq_tail = 0;
+    _mp->cq_overflowed = 0;
     try_module_get(THIS_MODULE);
     list_add((struct list_head*)_mp, &mp_list);
     printk(KERN_INFO "cbnotif: process %d successfully opened file\n", pid);    
   } else {
+    ++_mp->users;
     printk(KERN_INFO "cbnotif: process %d already opened file\n", pid);        
   }
+  file->private_data = _mp;
 
   mutex_unlock(&mp_list_mutex);
   return SUCCESS;
 }
 
 static int release_device(struct inode * inode, struct file * file) {
-  struct list_head * mp, * mi;
-  struct cbnotif_monitoring_process * _mp;
+  struct list_head * mi, * tmp;
+  struct cbnotif_monitoring_process * _mp = file->private_data;
   struct cbnotif_monitored_inode    * _mi;
-  struct file_operations * fops;  
   pid_t pid = get_current()->pid;
   printk(KERN_INFO "cbnotif: release_device inode = %p; file = %p; pid = %d\n", inode, file, pid);
 
   mutex_lock(&mp_list_mutex);
-  if (list_empty(&mp_list)) {
-    printk(KERN_WARNING "cbnotif: something wong - close closed file pid = %d\n", pid);
+  // other open files of the process share _mp
+  if (--_mp->users) {
     mutex_unlock(&mp_list_mutex);
-    return -EBADF;
+    return SUCCESS;
   }
-
-  list_for_each(mp, &mp_list) {
-    _mp = (struct cbnotif_monitoring_process*)mp;
-    if (_mp->pid == pid) {
-      break;
-    }
-  }
-  if (&mp_list == mp) {
-    printk(KERN_WARNING "cbnotif: something wong - close closed file pid = %d\n", pid);    
-    mutex_unlock(&mp_list_mutex);
-    return -EBADF;
-  }    
-  list_del(mp);
-  mutex_unlock(&mp_list_mutex);
-  printk(KERN_INFO "cbnotif: process %d is removed from the list\n", pid);
+  list_del(&_mp->next_process);
+  printk(KERN_INFO "cbnotif: process %ld is removed from the list\n", _mp->pid);
   mutex_lock(&_mp->mp_mutex);
-  // need to ensure that other threads of current process already gone.
   list_for_each(mi, &_mp->monitored_inodes) {
     _mi = (struct cbnotif_monitored_inode*)mi;
-    if (mi->prev != &_mp->monitored_inodes) {
-      kfree(mi->prev);
-    }
-    mutex_lock(&_mi->mi_mutex);
-    mutex_lock(&_mi->inode->i_mutex);
-
-    fops = (struct file_operations*)_mi->inode->i_fop;
-    fops->write = _mi->orig_write;
-    fops->aio_write = _mi->orig_aio_write;
-    fops->sendpage = _mi->orig_sendpage;
-    fops->splice_write = _mi->orig_splice_write;    
-    
-    mutex_unlock(&_mi->inode->i_mutex);    
-    atomic_dec(&_mi->inode->i_count);
-    mutex_unlock(&_mi->mi_mutex);
-  }
-  if (!list_empty(&_mp->monitored_inodes))
-    kfree(mi->prev);  
+    hlist_del_rcu(&_mi->hash_node);
+    unhook_fops(_mi->hf);
+  }
+  idr_remove_all(&_mp->mi_idr);
+  idr_destroy(&_mp->mi_idr);
   mutex_unlock(&_mp->mp_mutex);
+  mutex_unlock(&mp_list_mutex);
+  // wait for writers which found the inodes before
+  synchronize_srcu(&mi_srcu);
+  list_for_each_safe(mi, tmp, &_mp->monitored_inodes) {
+    list_del(mi);
+    free_mi((struct cbnotif_monitored_inode*)mi);
+  }
   module_put(THIS_MODULE);
-  kfree(mp);
+  kfree(_mp);
   
   return SUCCESS;  
 }
+
 /**
  * read_device - reads a command from a process and executed it.
  *
@@ -315,127 +470,1537 @@ static ssize_t write_device(struct file * file, const char * buf, size_t bufsize
   return bufsize;  
 }
 
+/**
+ * ioctl_device - executes a command (CBN_*) of a monitoring process
+ * @arg: pointer to the command structure in user space
+ */
+static long ioctl_device(struct file * file, unsigned int cmd, unsigned long arg) {
+  struct cbnotif_monitoring_process * mp = file->private_data;
+  printk(KERN_INFO "cbnotif: ioctl_device file = %p; cmd = %u\n", file, cmd);
+  switch (cmd) {
+  case CBN_MONITOR:
+    return monitor_cmd(mp, (void __user *)arg, 0);
+  case CBN_MONITOR_FLAGS:
+    return monitor_cmd(mp, (void __user *)arg, 1);
+  case CBN_FORGET:
+    return forget_cmd(mp, (int)arg);
+  case CBN_CHANGED_BLOCKS:
+    return changed_blocks_cmd(mp, (struct cbn_changed_blocks __user *)arg);
+  case CBN_CHANGED_EXTENTS:
+    return changed_extents_cmd(mp, (struct cbn_changed_extents __user *)arg);
+  case CBN_HOT_EXTENTS:
+    return hot_extents_cmd(mp, (struct cbn_heat __user *)arg);
+  case CBN_STREAM_BLOCKS:
+    return stream_blocks_cmd(mp, (struct cbn_stream __user *)arg);
+  case CBN_CUT:
+    return cut_cmd(mp, (struct cbn_cut __user *)arg);
+  case CBN_FROZEN_BLOCKS:
+    return frozen_blocks_cmd(mp, (struct cbn_frozen_blocks __user *)arg);
+  case CBN_SUBMIT:
+    return submit_cmd(mp, (struct cbn_submit __user *)arg);
+  case CBN_REAP:
+    return reap_cmd(mp, (struct cbn_reap __user *)arg);
+  default:
+    return -ENOTTY;
+  }
+}
+
+/**
+ * monitor_cmd - starts monitoring of the file for changed blocks
+ * @ucmd: cbn_monitor or cbn_monitor_flags
+ * @with_flags: @ucmd is cbn_monitor_flags
+ *
+ * Returns id of the file or an error:
+ *   -EFAULT, -EINVAL, -ENOMEM, -EEXIST (the process already monitors the file),
+ *   -ENOSPC (ids are exhausted), errors of the path lookup and the permission check
+ */
+static long monitor_cmd(struct cbnotif_monitoring_process * mp, void __user * ucmd, int with_flags) {
+  struct cbn_monitor_flags cmd;
+  const char __user * path_name;
+  size_t header;
+  struct cbnotif_monitored_inode * mi, * _mi;
+  struct hlist_head * bucket;
+  struct hlist_node * node;
+  struct inode * inode;
+  struct path path;
+  long r;
+  if (with_flags) {
+    header = offsetof(struct cbn_monitor_flags, cbn_path);
+    if (copy_from_user(&cmd, ucmd, header))
+      return -EFAULT;
+    path_name = ((struct cbn_monitor_flags __user *)ucmd)->cbn_path;
+  } else {
+    struct cbn_monitor old;
+    header = offsetof(struct cbn_monitor, cbn_path);
+    if (copy_from_user(&old, ucmd, header))
+      return -EFAULT;
+    cmd.cbn_size = old.cbn_size;
+    cmd.cbn_block_size = old.cbn_block_size;
+    cmd.cbn_flags = 0;
+    path_name = ((struct cbn_monitor __user *)ucmd)->cbn_path;
+  }
+  if (cmd.cbn_block_size <= 0
+      || cmd.cbn_size <= header
+      || cmd.cbn_size > MAX_REQUEST_SIZE
+      || (cmd.cbn_flags & ~CBN_MONITOR_HEAT))
+    return -EINVAL;
+  r = cbnotif_find_inode(path_name, &path, LOOKUP_FOLLOW);
+  if (r)
+    return r;
+  inode = path.dentry->d_inode;
+  if (!S_ISREG(inode->i_mode)) {
+    r = -EINVAL;
+    goto out;
+  }
+  mi = (struct cbnotif_monitored_inode*)kmalloc(sizeof(struct cbnotif_monitored_inode), GFP_KERNEL);
+  if (!mi) {
+    r = -ENOMEM;
+    goto out;
+  }
+  INIT_LIST_HEAD(&mi->next_inode);
+  INIT_HLIST_NODE(&mi->hash_node);
+  mi->mp = mp;
+  mi->inode = 0;
+  mutex_init(&mi->mi_mutex);
+  mi->block_size = cmd.cbn_block_size;
+  mi->num_dblocks = 0;
+  mi->flags = cmd.cbn_flags;
+  mi->heat = 0;
+  mi->heat_stamp = jiffies;
+  mi->heat_epochs = 0;
+  if (mi->flags & CBN_MONITOR_HEAT) {
+    mi->heat = (struct cbnotif_heat_chunk**)vzalloc(HEAT_CHUNKS * sizeof(struct cbnotif_heat_chunk*));
+    if (!mi->heat) {
+      kfree(mi);
+      r = -ENOMEM;
+      goto out;
+    }
+  }
+  INIT_LIST_HEAD(&mi->dblocks);
+  mi->extent_resume = 0;
+  INIT_LIST_HEAD(&mi->frozen);
+  mi->append_active = 0;
+  mi->append_start = 0;
+  mi->append_next = 0;
+  mi->query_armed = 0;
+  mi->query_threshold = 0;
+  mi->query_cookie = 0;
 
-static ssize_t write_inode(struct file * file, const char __user * data, size_t len, loff_t * ofs) {
-  struct cbnotif_monitored_inode * mi = 0;
-  printk(KERN_INFO "cbnotif: write_inode file = %p; len = %u\n", file, len);
-  mi = get_mi_by_file(file);
+  bucket = &mi_hash[hash_ptr(inode, MI_HASH_BITS)];
+  mutex_lock(&mp_list_mutex);
+  mutex_lock(&mp->mp_mutex);
+  hlist_for_each_entry(_mi, node, bucket, hash_node) {
+    if (_mi->inode == inode && _mi->mp == mp) {
+      r = -EEXIST;
+      goto unlock;
+    }
+  }
+  // only holders of mp_mutex take the preallocated layers
+  if (!idr_pre_get(&mp->mi_idr, GFP_KERNEL)) {
+    r = -ENOMEM;
+    goto unlock;
+  }
+  r = idr_get_new_above(&mp->mi_idr, mi, mp->next_id, &mi->id);
+  if (r) {
+    if (r == -EAGAIN)
+      r = -ENOMEM;
+    goto unlock;
+  }
+  mi->hf = hook_fops((struct file_operations*)inode->i_fop);
+  if (!mi->hf) {
+    idr_remove(&mp->mi_idr, mi->id);
+    r = -ENOMEM;
+    goto unlock;
+  }
+  mi->inode = igrab(inode);
+  mp->next_id = mi->id + 1;
+  list_add_tail(&mi->next_inode, &mp->monitored_inodes);
+  // writers see the inode from now on
+  hlist_add_head_rcu(&mi->hash_node, bucket);
+  r = mi->id;
+  mi = 0;
+ unlock:
+  mutex_unlock(&mp->mp_mutex);
+  mutex_unlock(&mp_list_mutex);
   if (mi) {
-    ssize_t (*writep) (struct file *, const char __user *, size_t, loff_t *);
-    writep = mi->orig_write;
-    //mutex_unlock(mi->inode->i_mutex);
-    mutex_unlock(&mi->mi_mutex);
-    return writep(file, data, len, ofs);    
+    vfree(mi->heat);
+    kfree(mi);
   }
-  return -ENXIO;
+ out:
+  path_put(&path);
+  return r;
 }
-static ssize_t aio_write_inode(struct kiocb * kiocb, const struct iovec * iovec, unsigned long len, loff_t ofs) {
-  struct cbnotif_monitored_inode * mi = 0;
-  printk(KERN_INFO "cbnotif: aio_write_inode file = %p; len = %ld\n", kiocb->ki_filp, len);
-  mi = get_mi_by_file(kiocb->ki_filp);
+
+/**
+ * forget_cmd - stops monitoring of the file
+ *
+ * Returns 0 or -EBADF
+ */
+static long forget_cmd(struct cbnotif_monitoring_process * mp, int id) {
+  struct cbnotif_monitored_inode * mi;
+  mutex_lock(&mp_list_mutex);
+  mutex_lock(&mp->mp_mutex);
+  mi = find_mi(mp, id);
   if (mi) {
-    ssize_t (*aio_writep)(struct kiocb *, const struct iovec *, unsigned long, loff_t);
-    aio_writep = mi->orig_aio_write;
-    //mutex_unlock(mi->inode->i_mutex);
+    idr_remove(&mp->mi_idr, id);
+    list_del(&mi->next_inode);
+    hlist_del_rcu(&mi->hash_node);
+    unhook_fops(mi->hf);
+  }
+  mutex_unlock(&mp->mp_mutex);
+  mutex_unlock(&mp_list_mutex);
+  if (!mi)
+    return -EBADF;
+  // wait for writers and a command which found the inode before
+  synchronize_srcu(&mi_srcu);
+  mutex_lock(&mi->mi_mutex);
+  mutex_unlock(&mi->mi_mutex);
+  free_mi(mi);
+  return SUCCESS;
+}
+
+/**
+ * changed_blocks_cmd - fills the user buffer with numbers of dirty blocks
+ *
+ * Reported blocks are removed from the dirty list. If they cannot
+ * be copied to the user then they are returned to the list.
+ * Returns the number of elements in cbn_blocks or an error:
+ *   -EFAULT, -EINVAL, -ENOMEM, -EBADF
+ */
+static long changed_blocks_cmd(struct cbnotif_monitoring_process * mp, struct cbn_changed_blocks __user * ucmd) {
+  struct cbn_changed_blocks cmd;
+  struct cbnotif_monitored_inode * mi;
+  int * blocks;
+  int count;
+  if (copy_from_user(&cmd, ucmd, sizeof(cmd)))
+    return -EFAULT;
+  if (cmd.cbn_max < 2 // a range needs 2 elements
+      || cmd.cbn_size < sizeof(cmd) + cmd.cbn_max * sizeof(int))
+    return -EINVAL;
+  if (sizeof(cmd) + cmd.cbn_max * sizeof(int) > MAX_REQUEST_SIZE)
+    cmd.cbn_max = (MAX_REQUEST_SIZE - sizeof(cmd)) / sizeof(int);
+  blocks = (int*)kmalloc(cmd.cbn_max * sizeof(int), GFP_KERNEL);
+  if (!blocks)
+    return -ENOMEM;
+  mi = get_mi_by_id(mp, cmd.cbn_file);
+  if (!mi) {
+    kfree(blocks);
+    return -EBADF;
+  }
+  append_flush(mi);
+  mi->extent_resume = 0;
+  count = encode_dblocks(&mi->dblocks, blocks, cmd.cbn_max);
+  if (list_empty(&mi->dblocks))
+    mi->num_dblocks = 0;
+  else if (mi->num_dblocks > 0)
+    mi->num_dblocks -= count_blocks(blocks, count);
+  mutex_unlock(&mi->mi_mutex);
+  cmd.cbn_count = count;
+  if (copy_to_user(ucmd, &cmd, sizeof(cmd))
+      || copy_to_user(ucmd->cbn_blocks, blocks, count * sizeof(int))) {
+    mi = get_mi_by_id(mp, cmd.cbn_file);
+    if (mi) {
+      count_dblocks(mi, restore_blocks(&mi->dblocks, blocks, count));
+      mutex_unlock(&mi->mi_mutex);
+    }
+    kfree(blocks);
+    return -EFAULT;
+  }
+  kfree(blocks);
+  return count;
+}
+
+/**
+ * changed_extents_cmd - fills the user buffer with physical extents of dirty blocks
+ *
+ * The dirty list is detached before the file is flushed, so writes
+ * during the flush and the mapping stay dirty. Ranges which aren't
+ * reported (the buffer is too small, an error, a fault of copying
+ * to the user) are returned to the list for the next call.
+ * Returns the number of extents or an error:
+ *   -EFAULT, -EINVAL, -ENOMEM, -EBADF, -EOPNOTSUPP (filesystem has no fiemap),
+ *   errors of flushing the file and of ->fiemap
+ */
+static long changed_extents_cmd(struct cbnotif_monitoring_process * mp, struct cbn_changed_extents __user * ucmd) {
+  struct cbn_changed_extents cmd;
+  struct cbnotif_monitored_inode * mi;
+  struct cbnotif_dirty_block * db;
+  struct cbn_extent * extents;
+  struct fiemap_extent * fes;
+  struct inode * inode;
+  LIST_HEAD(ranges);
+  loff_t resume;
+  long r;
+  int block_size, count = 0, i;
+  if (copy_from_user(&cmd, ucmd, sizeof(cmd)))
+    return -EFAULT;
+  if (cmd.cbn_max <= 0
+      || cmd.cbn_size < sizeof(cmd) + cmd.cbn_max * sizeof(struct cbn_extent))
+    return -EINVAL;
+  if (sizeof(cmd) + cmd.cbn_max * sizeof(struct cbn_extent) > MAX_REQUEST_SIZE)
+    cmd.cbn_max = (MAX_REQUEST_SIZE - sizeof(cmd)) / sizeof(struct cbn_extent);
+  extents = (struct cbn_extent*)kmalloc(cmd.cbn_max * sizeof(struct cbn_extent), GFP_KERNEL);
+  fes = (struct fiemap_extent*)kmalloc(FIEMAP_BATCH * sizeof(struct fiemap_extent), GFP_KERNEL);
+  if (!extents || !fes) {
+    r = -ENOMEM;
+    goto free;
+  }
+  mi = get_mi_by_id(mp, cmd.cbn_file);
+  if (!mi) {
+    r = -EBADF;
+    goto free;
+  }
+  // the file may be forgotten while its data is flushed
+  inode = igrab(mi->inode);
+  if (!inode->i_op->fiemap) {
     mutex_unlock(&mi->mi_mutex);
-    return aio_writep(kiocb, iovec, len, ofs);    
+    r = -EOPNOTSUPP;
+    goto out;
+  }
+  append_flush(mi);
+  resume = mi->extent_resume;
+  mi->extent_resume = 0;
+  list_splice_init(&mi->dblocks, &ranges);
+  mi->num_dblocks = 0;
+  block_size = mi->block_size;
+  mutex_unlock(&mi->mi_mutex);
+  // delayed allocation leaves fresh blocks unmapped and
+  // O_DIRECT readers of the device must see the data
+  r = filemap_write_and_wait(inode->i_mapping);
+  if (!r)
+    r = map_dirty_extents(inode, block_size, &ranges, &resume, extents, cmd.cbn_max, fes);
+  if (r >= 0) {
+    count = r;
+    cmd.cbn_count = count;
+    cmd.cbn_dev_major = MAJOR(inode->i_sb->s_dev);
+    cmd.cbn_dev_minor = MINOR(inode->i_sb->s_dev);
+    if (copy_to_user(ucmd, &cmd, sizeof(cmd))
+        || copy_to_user(ucmd->cbn_extents, extents, count * sizeof(struct cbn_extent)))
+      r = -EFAULT;
+  }
+  if (r < 0 || !list_empty(&ranges)) {
+    mi = get_mi_by_id(mp, cmd.cbn_file);
+    if (mi) {
+      // bytes before resume may be written again while the list was detached
+      if (!list_empty(&mi->dblocks)
+          && (loff_t)list_first_entry(&mi->dblocks, struct cbnotif_dirty_block, next)->first
+             * block_size < resume)
+        resume = 0;
+      list_for_each_entry(db, &ranges, next)
+        count_dblocks(mi, add_range(&mi->dblocks, db->first, db->first + db->length - 1));
+      mi->extent_resume = resume;
+      if (r == -EFAULT)
+        for (i = 0; i < count; ++i)
+          mark_dirty(mi, extents[i].cbn_logical, extents[i].cbn_length);
+      mutex_unlock(&mi->mi_mutex);
+    }
+    free_dblocks(&ranges);
   }
-  return -ENXIO;  
+ out:
+  iput(inode);
+ free:
+  kfree(fes);
+  kfree(extents);
+  return r;
 }
 
-static ssize_t sendpage_inode(struct file * file, struct page * page, int i1, size_t s, loff_t * ofs, int i2) {
-  struct cbnotif_monitored_inode * mi = 0;
-  printk(KERN_INFO "cbnotif: aio_write_inode file = %p\n", file);
-  mi = get_mi_by_file(file);
-  if (mi) {
-    ssize_t (*sendpagep)(struct file *, struct page *, int, size_t, loff_t *, int);
-    sendpagep = mi->orig_sendpage;
-    //mutex_unlock(mi->inode->i_mutex);
+/**
+ * map_dirty_extents - converts dirty block ranges to extents with ->fiemap
+ * @ranges: detached dirty ranges of the file
+ * @resume: bytes before it are already reported
+ * @extents: output array
+ * @max: length of @extents
+ * @fes: buffer for FIEMAP_BATCH extents of ->fiemap
+ *
+ * Consumes @ranges. Ranges are widened to blocks of the filesystem,
+ * so extents can be read with O_DIRECT. Unallocated parts are reported
+ * as holes. If @extents is full in the middle of a range then the
+ * reported part is remembered in @resume so each call advances.
+ * Returns the number of filled extents or an error of ->fiemap.
+ */
+static int map_dirty_extents(struct inode * inode, int block_size, struct list_head * ranges,
+                             loff_t * resume, struct cbn_extent * extents, int max,
+                             struct fiemap_extent * fes) {
+  struct cbnotif_dirty_block * db, * tmp;
+  const loff_t size = i_size_read(inode);
+  const loff_t fs_mask = (1 << inode->i_blkbits) - 1;
+  struct fiemap_extent_info fieinfo;
+  mm_segment_t old_fs;
+  loff_t start, end, done;
+  int count = 0, i, r;
+  list_for_each_entry_safe(db, tmp, ranges, next) {
+    start = (loff_t)db->first * block_size;
+    end = (loff_t)(db->first + db->length) * block_size;
+    if (end > size)
+      end = size;
+    if (start < end) {
+      start &= ~fs_mask;
+      end = (end + fs_mask) & ~fs_mask;
+    }
+    // a filesystem block shared with the previous range is reported once
+    if (start < *resume)
+      start = *resume;
+    while (start < end) {
+      done = start;
+      fieinfo.fi_flags = 0;
+      fieinfo.fi_extents_mapped = 0;
+      fieinfo.fi_extents_max = FIEMAP_BATCH;
+      fieinfo.fi_extents_start = (struct fiemap_extent __user *)fes;
+      // ->fiemap copies extents with copy_to_user
+      old_fs = get_fs();
+      set_fs(KERNEL_DS);
+      r = inode->i_op->fiemap(inode, &fieinfo, start, end - start);
+      set_fs(old_fs);
+      if (r)
+        goto fail;
+      for (i = 0; i < fieinfo.fi_extents_mapped && start < end; ++i) {
+        struct fiemap_extent * fe = &fes[i];
+        loff_t fe_end = min_t(loff_t, fe->fe_logical + fe->fe_length, end);
+        int flags = 0;
+        if (fe->fe_logical > start) {
+          r = add_extent(extents, count, max, start, 0,
+                         min_t(loff_t, fe->fe_logical, end) - start, CBN_EXTENT_HOLE);
+          if (r < 0)
+            goto full;
+          count = r;
+          start = min_t(loff_t, fe->fe_logical, end);
+        }
+        if (fe_end <= start)
+          continue;
+        if (fe->fe_flags & FIEMAP_EXTENT_UNWRITTEN)
+          flags |= CBN_EXTENT_UNWRITTEN;
+        if (fe->fe_flags & (FIEMAP_EXTENT_UNKNOWN | FIEMAP_EXTENT_DELALLOC | FIEMAP_EXTENT_ENCODED
+                            | FIEMAP_EXTENT_DATA_ENCRYPTED | FIEMAP_EXTENT_NOT_ALIGNED
+                            | FIEMAP_EXTENT_DATA_INLINE | FIEMAP_EXTENT_DATA_TAIL))
+          flags |= CBN_EXTENT_NOT_DIRECT;
+        r = add_extent(extents, count, max, start,
+                       fe->fe_physical + (start - fe->fe_logical), fe_end - start, flags);
+        if (r < 0)
+          goto full;
+        count = r;
+        start = fe_end;
+      }
+      if (start < end && (!fieinfo.fi_extents_mapped
+                          || (fes[fieinfo.fi_extents_mapped - 1].fe_flags & FIEMAP_EXTENT_LAST))) {
+        // nothing is allocated up to the end of the range
+        r = add_extent(extents, count, max, start, 0, end - start, CBN_EXTENT_HOLE);
+        if (r < 0)
+          goto full;
+        count = r;
+        start = end;
+      }
+      if (start == done) {
+        r = -EIO; // ->fiemap returned nothing at start
+        goto fail;
+      }
+    }
+    if (end > *resume)
+      *resume = end;
+    list_del(&db->next);
+    kfree(db);
+  }
+  *resume = 0;
+  return count;
+ fail:
+  if (!count)
+    return r;
+ full:
+  // db is reported up to start
+  *resume = start;
+  if (start >= (loff_t)(db->first + db->length) * block_size) {
+    list_del(&db->next);
+    kfree(db);
+  } else if (start > (loff_t)db->first * block_size) {
+    int rest = start / block_size;
+    db->length -= rest - db->first;
+    db->first = rest;
+  }
+  return count;
+}
+
+/**
+ * add_extent - appends the extent or merges it with the last one
+ *
+ * Returns the new number of extents or -1 if @extents is full.
+ */
+static int add_extent(struct cbn_extent * extents, int count, int max,
+                      loff_t logical, loff_t physical, loff_t length, int flags) {
+  struct cbn_extent * last = count ? &extents[count - 1] : 0;
+  if (last && last->cbn_flags == flags
+      && last->cbn_logical + last->cbn_length == logical
+      && ((flags & CBN_EXTENT_HOLE) || last->cbn_physical + last->cbn_length == physical)) {
+    last->cbn_length += length;
+    return count;
+  }
+  if (count == max)
+    return -1;
+  last = &extents[count];
+  last->cbn_logical = logical;
+  last->cbn_physical = physical;
+  last->cbn_length = length;
+  last->cbn_flags = flags;
+  return count + 1;
+}
+
+/**
+ * hot_extents_cmd - fills the user buffer with the hottest extents and heat histogram
+ *
+ * Counters are decayed to the current epoch; blocks without counters
+ * up to the end of the file are cold. Counters are copied one chunk
+ * at a time, so writers wait for mi_mutex only while a chunk is copied.
+ * Returns the number of extents or an error:
+ *   -EFAULT, -EINVAL, -ENOMEM, -EBADF, -ENODATA (file is monitored without CBN_MONITOR_HEAT)
+ */
+static long hot_extents_cmd(struct cbnotif_monitoring_process * mp, struct cbn_heat __user * ucmd) {
+  struct cbn_heat cmd;
+  struct cbnotif_monitored_inode * mi;
+  struct cbn_hot_extent * extents;
+  struct cbn_hot_extent run = { 0 };
+  unsigned char * heat;
+  loff_t nblocks = 1;
+  int count = 0, bucket = -1, block, i;
+  long r;
+  if (copy_from_user(&cmd, ucmd, sizeof(cmd)))
+    return -EFAULT;
+  if (cmd.cbn_max < 0
+      || cmd.cbn_size < sizeof(cmd) + cmd.cbn_max * sizeof(struct cbn_hot_extent))
+    return -EINVAL;
+  if (sizeof(cmd) + cmd.cbn_max * sizeof(struct cbn_hot_extent) > MAX_REQUEST_SIZE)
+    cmd.cbn_max = (MAX_REQUEST_SIZE - sizeof(cmd)) / sizeof(struct cbn_hot_extent);
+  extents = (struct cbn_hot_extent*)kmalloc((cmd.cbn_max + 1) * sizeof(struct cbn_hot_extent), GFP_KERNEL);
+  heat = (unsigned char*)kmalloc(HEAT_CHUNK, GFP_KERNEL);
+  if (!extents || !heat) {
+    r = -ENOMEM;
+    goto out;
+  }
+  memset(cmd.cbn_histogram, 0, sizeof(cmd.cbn_histogram));
+  for (block = 0; block < nblocks; block += HEAT_CHUNK) {
+    // the file may be forgotten between chunks
+    mi = get_mi_by_id(mp, cmd.cbn_file);
+    if (!mi) {
+      r = -EBADF;
+      goto out;
+    }
+    if (!(mi->flags & CBN_MONITOR_HEAT)) {
+      mutex_unlock(&mi->mi_mutex);
+      r = -ENODATA;
+      goto out;
+    }
+    if (!block) {
+      nblocks = (i_size_read(mi->inode) + mi->block_size - 1) / mi->block_size;
+      if (nblocks > MAX_HEAT_BLOCKS)
+        nblocks = MAX_HEAT_BLOCKS;
+    }
+    if (mi->heat[block / HEAT_CHUNK]) {
+      heat_decay(mi->heat[block / HEAT_CHUNK], heat_epoch(mi));
+      memcpy(heat, mi->heat[block / HEAT_CHUNK]->heat, HEAT_CHUNK);
+    } else {
+      memset(heat, 0, HEAT_CHUNK);
+    }
     mutex_unlock(&mi->mi_mutex);
-    return sendpagep(file, page, i1, s, ofs, i2);    
+    for (i = 0; i < HEAT_CHUNK && block + i < nblocks; ++i) {
+      if (heat_bucket(heat[i]) != bucket) {
+        // runs cross chunks
+        if (bucket >= 0) {
+          cmd.cbn_histogram[bucket] += run.cbn_length;
+          if (bucket)
+            count = add_hot_extent(extents, count, cmd.cbn_max, &run);
+        }
+        bucket = heat_bucket(heat[i]);
+        run.cbn_first = block + i;
+        run.cbn_length = 0;
+        run.cbn_heat = 0;
+      }
+      ++run.cbn_length;
+      if (heat[i] > run.cbn_heat)
+        run.cbn_heat = heat[i];
+    }
+  }
+  if (bucket >= 0) {
+    cmd.cbn_histogram[bucket] += run.cbn_length;
+    if (bucket)
+      count = add_hot_extent(extents, count, cmd.cbn_max, &run);
   }
-  return -ENXIO;  
+  cmd.cbn_count = count;
+  r = count;
+  if (copy_to_user(ucmd, &cmd, sizeof(cmd))
+      || copy_to_user(ucmd->cbn_extents, extents, count * sizeof(struct cbn_hot_extent)))
+    r = -EFAULT;
+ out:
+  kfree(heat);
+  kfree(extents);
+  return r;
 }
 
-static ssize_t splice_write_inode(struct pipe_inode_info * pipe, struct file * file,
-                                  loff_t * ofs, size_t s, unsigned int ui) {
-  struct cbnotif_monitored_inode * mi = 0;
-  printk(KERN_INFO "cbnotif: aio_write_inode file = %p\n", file);
-  mi = get_mi_by_file(file);
-  if (mi) {
-    ssize_t (*splice_writep)(struct pipe_inode_info *, struct file *, loff_t *, size_t, unsigned int);
-    splice_writep = mi->orig_splice_write;
-    //mutex_unlock(mi->inode->i_mutex);
+/**
+ * add_hot_extent - inserts the run into the list of hottest extents
+ * @extents: sorted by heat, hottest first; extents[@max] is a spare slot
+ *
+ * Returns the new number of extents.
+ */
+static int add_hot_extent(struct cbn_hot_extent * extents, int count, int max,
+                          const struct cbn_hot_extent * run) {
+  int j;
+  for (j = count; j > 0 && extents[j - 1].cbn_heat < run->cbn_heat; --j)
+    extents[j] = extents[j - 1];
+  extents[j] = *run;
+  return count < max ? count + 1 : count;
+}
+
+/**
+ * stream_blocks_cmd - pushes records of dirty ranges into the destination file
+ *
+ * The dirty list is detached at once so writers aren't blocked while
+ * the data is streamed. Ranges which aren't sent because of an error
+ * are returned to the dirty list.
+ * The destination must be blocking: a record is never left half written
+ * for a full pipe or socket. If an error is returned then the stream
+ * may end in the middle of a record and the destination must be closed.
+ * Returns the number of records or an error:
+ *   -EFAULT, -EINVAL (nonblocking destination or another source file), -EBADF,
+ *   errors of writing into the destination
+ */
+static long stream_blocks_cmd(struct cbnotif_monitoring_process * mp, struct cbn_stream __user * ucmd) {
+  struct cbn_stream cmd;
+  struct cbnotif_monitored_inode * mi;
+  struct cbnotif_dirty_block * db, * tmp;
+  struct file * src, * dst;
+  LIST_HEAD(ranges);
+  int block_size;
+  long r = 0;
+  if (copy_from_user(&cmd, ucmd, sizeof(cmd)))
+    return -EFAULT;
+  if (cmd.cbn_size < sizeof(cmd))
+    return -EINVAL;
+  src = fget(cmd.cbn_src_fd);
+  if (!src)
+    return -EBADF;
+  dst = fget(cmd.cbn_dst_fd);
+  if (!dst) {
+    fput(src);
+    return -EBADF;
+  }
+  if (!(src->f_mode & FMODE_READ) || !(dst->f_mode & FMODE_WRITE)) {
+    r = -EBADF;
+    goto out;
+  }
+  if (dst->f_flags & O_NONBLOCK) {
+    r = -EINVAL;
+    goto out;
+  }
+  mi = get_mi_by_id(mp, cmd.cbn_file);
+  if (!mi) {
+    r = -EBADF;
+    goto out;
+  }
+  if (src->f_path.dentry->d_inode != mi->inode) {
     mutex_unlock(&mi->mi_mutex);
-    return splice_writep(pipe, file, ofs, s, ui);    
+    r = -EINVAL;
+    goto out;
+  }
+  append_flush(mi);
+  mi->extent_resume = 0;
+  list_splice_init(&mi->dblocks, &ranges);
+  mi->num_dblocks = 0;
+  block_size = mi->block_size;
+  mutex_unlock(&mi->mi_mutex);
+  list_for_each_entry_safe(db, tmp, &ranges, next) {
+    int e = stream_range(block_size, i_size_read(src->f_path.dentry->d_inode), db, src, dst);
+    if (e < 0) {
+      r = e;
+      break;
+    }
+    ++r;
+    list_del(&db->next);
+    kfree(db);
   }
-  return -ENXIO;  
+  if (!list_empty(&ranges)) {
+    // the file may be forgotten while it was streamed
+    mi = get_mi_by_id(mp, cmd.cbn_file);
+    if (mi) {
+      list_for_each_entry(db, &ranges, next)
+        count_dblocks(mi, add_range(&mi->dblocks, db->first, db->first + db->length - 1));
+      mutex_unlock(&mi->mi_mutex);
+    }
+    free_dblocks(&ranges);
+  }
+ out:
+  fput(dst);
+  fput(src);
+  return r;
+}
+
+/**
+ * stream_range - writes the record header and the data of the range
+ * @size: size of the file the record length is computed for
+ * @src: the monitored file
+ * @dst: blocking pipe or socket
+ *
+ * Pages are moved into a pipe with ->splice_read of the file and
+ * into a socket with ->sendpage by do_splice_direct(), so the data
+ * isn't copied. If the file has shrunk since @size was taken
+ * then the rest of the record is padded with zeros.
+ */
+static int stream_range(int block_size, loff_t size, struct cbnotif_dirty_block * db,
+                        struct file * src, struct file * dst) {
+  struct cbn_record rec;
+  struct inode * dst_inode = dst->f_path.dentry->d_inode;
+  loff_t pos = (loff_t)db->first * block_size;
+  loff_t end = (loff_t)(db->first + db->length) * block_size;
+  long spliced;
+  int e;
+  if (end > size)
+    end = size;
+  rec.cbn_magic = CBN_RECORD_MAGIC;
+  rec.cbn_block_size = block_size;
+  rec.cbn_first = db->first;
+  rec.cbn_length = db->length;
+  rec.cbn_bytes = end > pos ? end - pos : 0;
+  e = stream_write(dst, (const char *)&rec, sizeof(rec));
+  if (e)
+    return e;
+  while (pos < end) {
+    if (S_ISFIFO(dst_inode->i_mode) && dst_inode->i_pipe && src->f_op->splice_read)
+      // do_splice_direct() would copy pages into a pipe with ->write
+      spliced = src->f_op->splice_read(src, &pos, dst_inode->i_pipe, end - pos, 0);
+    else
+      spliced = do_splice_direct(src, &pos, dst, end - pos, 0);
+    if (spliced < 0)
+      return spliced;
+    if (!spliced)
+      break; // the file is truncated
+  }
+  while (pos < end) {
+    size_t chunk = min_t(loff_t, end - pos, PAGE_SIZE);
+    e = stream_write(dst, (const char *)page_address(ZERO_PAGE(0)), chunk);
+    if (e)
+      return e;
+    pos += chunk;
+  }
+  return 0;
 }
 
 /**
- * cbnotif_monitored_inode - returns cbnotif_monitored_inode for the specified file
- * @file: pointer to the struct file
+ * stream_write - writes the whole kernel buffer into the destination
  *
- * Returns 0 if file's inod is not found amoung monitored ones
- */ 
-static struct cbnotif_monitored_inode * get_mi_by_file(struct file * file) {
+ * Returns 0 or an error.
+ */
+static int stream_write(struct file * dst, const char * buf, size_t len) {
+  loff_t dst_pos = dst->f_pos;
+  mm_segment_t old_fs;
+  ssize_t w;
+  while (len) {
+    old_fs = get_fs();
+    set_fs(KERNEL_DS);
+    w = vfs_write(dst, (const char __user *)buf, len, &dst_pos);
+    set_fs(old_fs);
+    if (w < 0)
+      return w;
+    if (!w)
+      return -EIO;
+    dst->f_pos = dst_pos;
+    buf += w;
+    len -= w;
+  }
+  return 0;
+}
+
+/**
+ * poll_device - the device is readable while there are unreaped completions
+ */
+static unsigned int poll_device(struct file * file, poll_table * wait) {
+  struct cbnotif_monitoring_process * mp = file->private_data;
+  unsigned int mask = 0;
+  poll_wait(file, &mp->cq_wait, wait);
+  spin_lock(&mp->cq_lock);
+  if (mp->cq_head != mp->cq_tail)
+    mask |= POLLIN | POLLRDNORM;
+  spin_unlock(&mp->cq_lock);
+  return mask;
+}
+
+/**
+ * submit_cmd - arms queries of files
+ *
+ * Queries are copied in batches of a page, so their number isn't limited.
+ * They are armed in order; a query whose threshold is already met
+ * completes immediately.
+ * Returns the number of accepted queries; submission stops at
+ * the first unknown file or fault. Errors: -EFAULT, -EINVAL, -ENOMEM, -EBADF
+ */
+static long submit_cmd(struct cbnotif_monitoring_process * mp, struct cbn_submit __user * ucmd) {
+  struct cbn_submit cmd;
+  struct cbn_query * queries;
+  struct cbnotif_monitored_inode * mi;
+  const int batch = MAX_REQUEST_SIZE / sizeof(struct cbn_query);
+  int i = 0, j, n;
+  long r = -EBADF;
+  if (copy_from_user(&cmd, ucmd, sizeof(cmd)))
+    return -EFAULT;
+  if (cmd.cbn_count <= 0
+      || cmd.cbn_count > (INT_MAX - sizeof(cmd)) / sizeof(struct cbn_query)
+      || cmd.cbn_size < sizeof(cmd) + cmd.cbn_count * sizeof(struct cbn_query))
+    return -EINVAL;
+  queries = (struct cbn_query*)kmalloc(min(cmd.cbn_count, batch) * sizeof(struct cbn_query), GFP_KERNEL);
+  if (!queries)
+    return -ENOMEM;
+  while (i < cmd.cbn_count) {
+    n = min(cmd.cbn_count - i, batch);
+    if (copy_from_user(queries, ucmd->cbn_queries + i, n * sizeof(struct cbn_query))) {
+      r = -EFAULT;
+      break;
+    }
+    for (j = 0; j < n; ++j, ++i) {
+      mi = get_mi_by_id(mp, queries[j].cbn_file);
+      if (!mi)
+        goto out;
+      mi->query_cookie = queries[j].cbn_cookie;
+      mi->query_threshold = max(queries[j].cbn_threshold, 1);
+      mi->query_armed = 1;
+      check_query(mi);
+      mutex_unlock(&mi->mi_mutex);
+    }
+  }
+ out:
+  kfree(queries);
+  return i ? i : r;
+}
+
+/**
+ * reap_cmd - moves completions of the process into the user buffer
+ *
+ * Never blocks; use poll() to wait. Completions are removed from the ring
+ * only after they are copied, so a fault doesn't lose them.
+ * Returns the number of completions or an error: -EFAULT, -EINVAL, -ENOMEM
+ */
+static long reap_cmd(struct cbnotif_monitoring_process * mp, struct cbn_reap __user * ucmd) {
+  struct cbn_reap cmd;
+  struct cbn_completion * completions;
+  int count = 0;
+  if (copy_from_user(&cmd, ucmd, sizeof(cmd)))
+    return -EFAULT;
+  if (cmd.cbn_max <= 0
+      || cmd.cbn_size < sizeof(cmd) + cmd.cbn_max * sizeof(struct cbn_completion))
+    return -EINVAL;
+  if (cmd.cbn_max > CQ_SIZE)
+    cmd.cbn_max = CQ_SIZE;
+  completions = (struct cbn_completion*)kmalloc(cmd.cbn_max * sizeof(struct cbn_completion), GFP_KERNEL);
+  if (!completions)
+    return -ENOMEM;
+  mutex_lock(&mp->cq_mutex);
+  // writers don't overwrite slots from cq_head while the ring is full
+  spin_lock(&mp->cq_lock);
+  while (count < cmd.cbn_max && mp->cq_head + count != mp->cq_tail) {
+    completions[count] = mp->cq[(mp->cq_head + count) % CQ_SIZE];
+    ++count;
+  }
+  spin_unlock(&mp->cq_lock);
+  cmd.cbn_count = count;
+  if (copy_to_user(ucmd, &cmd, sizeof(cmd))
+      || copy_to_user(ucmd->cbn_completions, completions, count * sizeof(struct cbn_completion))) {
+    mutex_unlock(&mp->cq_mutex);
+    kfree(completions);
+    return -EFAULT;
+  }
+  spin_lock(&mp->cq_lock);
+  mp->cq_head += count;
+  spin_unlock(&mp->cq_lock);
+  mutex_unlock(&mp->cq_mutex);
+  kfree(completions);
+  if (count)
+    recheck_queries(mp);
+  return count;
+}
+
+/**
+ * recheck_queries - completes queries which didn't fit into the full ring
+ *
+ * Writes may have stopped, so such queries are checked again
+ * once the ring has room.
+ */
+static void recheck_queries(struct cbnotif_monitoring_process * mp) {
   struct list_head * mi;
-  struct cbnotif_monitored_inode * _mi;  
-  struct list_head * mp;
-  struct cbnotif_monitoring_process * _mp;  
-  int found = 0;
-  spin_lock(&file->f_lock);
-  printk(KERN_INFO "cbnotif: file spin is locked; file = %p;  name = %s\n",
-         file, file->f_path.dentry->d_name.name);
-  spin_lock(&file->f_path.dentry->d_lock);
-  printk(KERN_INFO "cbnotif: dentry spin is locked; file = %p; name = %s\n",
-         file, file->f_path.dentry->d_name.name);
-  mutex_lock(&mp_list_mutex);
-  // sequential search; slow but simple!
-  // FIXME:  one inode can be monitored multiple processes here 
-  //         handler is trigged only the cbnotif monitor
-  printk(KERN_INFO "cbnotif: go over list of montors\n");
-  list_for_each(mp, &mp_list) {
-    _mp = (struct cbnotif_monitoring_process*)mp;
-    mutex_lock(&_mp->mp_mutex);
-    list_for_each(mi, &_mp->monitored_inodes) {
-      _mi = (struct cbnotif_monitored_inode*)mi;
-      mutex_lock(&_mi->mi_mutex);
-      if (_mi->inode == file->f_path.dentry->d_inode) {
-        found = 1;        
+  int overflowed;
+  spin_lock(&mp->cq_lock);
+  overflowed = mp->cq_overflowed;
+  mp->cq_overflowed = 0;
+  spin_unlock(&mp->cq_lock);
+  if (!overflowed)
+    return;
+  mutex_lock(&mp->mp_mutex);
+  list_for_each(mi, &mp->monitored_inodes) {
+    mutex_lock(&((struct cbnotif_monitored_inode*)mi)->mi_mutex);
+    check_query((struct cbnotif_monitored_inode*)mi);
+    mutex_unlock(&((struct cbnotif_monitored_inode*)mi)->mi_mutex);
+  }
+  mutex_unlock(&mp->mp_mutex);
+}
+
+/**
+ * check_query - completes the armed query if its threshold is met
+ * @mi: locked monitored inode
+ *
+ * If the ring is full the query stays armed and is checked again
+ * at the next write or after completions are reaped.
+ */
+static void check_query(struct cbnotif_monitored_inode * mi) {
+  struct cbnotif_monitoring_process * mp = mi->mp;
+  int dirty = dirty_count(mi);
+  if (!mi->query_armed || (dirty >= 0 && dirty < mi->query_threshold))
+    return;
+  spin_lock(&mp->cq_lock);
+  if (mp->cq_tail - mp->cq_head < CQ_SIZE) {
+    struct cbn_completion * c = &mp->cq[mp->cq_tail++ % CQ_SIZE];
+    c->cbn_cookie = mi->query_cookie;
+    c->cbn_file = mi->id;
+    c->cbn_dirty = dirty;
+    mi->query_armed = 0;
+  } else {
+    mp->cq_overflowed = 1;
+  }
+  spin_unlock(&mp->cq_lock);
+  if (!mi->query_armed)
+    wake_up_interruptible(&mp->cq_wait);
+}
+
+static int cmp_int(const void * a, const void * b) {
+  return *(const int *)a - *(const int *)b;
+}
+
+/**
+ * cut_cmd - moves dirty blocks of the group of files to their frozen lists
+ *
+ * Inodes are locked in order of ids under mp_mutex, so writers of the group
+ * wait only for swapping list heads and the cut is consistent across files.
+ * Writers take no other lock while they wait for mi_mutex, and commands
+ * hold mi_mutex only for short list operations.
+ * Returns 0 or an error:
+ *   -EFAULT, -EINVAL (empty group or repeated id), -ENOMEM, -EBADF,
+ *   -EBUSY (frozen blocks of the previous cut aren't drained)
+ */
+static long cut_cmd(struct cbnotif_monitoring_process * mp, struct cbn_cut __user * ucmd) {
+  struct cbn_cut cmd;
+  struct cbnotif_monitored_inode ** mis;
+  int * ids;
+  int i, locked = 0;
+  long r = 0;
+  if (copy_from_user(&cmd, ucmd, sizeof(cmd)))
+    return -EFAULT;
+  if (cmd.cbn_count <= 0
+      || cmd.cbn_count > (MAX_REQUEST_SIZE - sizeof(cmd)) / sizeof(int)
+      || cmd.cbn_size < sizeof(cmd) + cmd.cbn_count * sizeof(int))
+    return -EINVAL;
+  mis = (struct cbnotif_monitored_inode **)kmalloc(cmd.cbn_count * (sizeof(*mis) + sizeof(int)), GFP_KERNEL);
+  if (!mis)
+    return -ENOMEM;
+  ids = (int*)(mis + cmd.cbn_count);
+  if (copy_from_user(ids, ucmd->cbn_files, cmd.cbn_count * sizeof(int))) {
+    kfree(mis);
+    return -EFAULT;
+  }
+  sort(ids, cmd.cbn_count, sizeof(int), cmp_int, 0);
+  for (i = 1; i < cmd.cbn_count; ++i)
+    if (ids[i - 1] == ids[i]) {
+      kfree(mis);
+      return -EINVAL;
+    }
+
+  mutex_lock(&mp->mp_mutex);
+  for (i = 0; i < cmd.cbn_count; ++i) {
+    mis[i] = find_mi(mp, ids[i]);
+    if (!mis[i]) {
+      r = -EBADF;
+      goto unlock;
+    }
+  }
+  // barrier; mp_mutex serializes lockers of several inodes
+  for (; locked < cmd.cbn_count; ++locked) {
+    mutex_lock_nest_lock(&mis[locked]->mi_mutex, &mp->mp_mutex);
+    if (!list_empty(&mis[locked]->frozen)) {
+      mutex_unlock(&mis[locked]->mi_mutex);
+      r = -EBUSY;
+      goto unlock;
+    }
+  }
+  for (i = 0; i < cmd.cbn_count; ++i) {
+    append_flush(mis[i]);
+    mis[i]->extent_resume = 0;
+    list_splice_init(&mis[i]->dblocks, &mis[i]->frozen);
+    mis[i]->num_dblocks = 0;
+  }
+ unlock:
+  while (locked > 0)
+    mutex_unlock(&mis[--locked]->mi_mutex);
+  mutex_unlock(&mp->mp_mutex);
+  kfree(mis);
+  return r;
+}
+
+/**
+ * frozen_blocks_cmd - fills the user buffer with blocks frozen by CBN_CUT
+ *
+ * Reported blocks are removed from the frozen list. If they cannot
+ * be copied to the user then they are returned to the list.
+ * Returns the number of elements in cbn_blocks or an error:
+ *   -EFAULT, -EINVAL, -ENOMEM, -EBADF
+ */
+static long frozen_blocks_cmd(struct cbnotif_monitoring_process * mp, struct cbn_frozen_blocks __user * ucmd) {
+  struct cbn_frozen_blocks cmd;
+  struct cbnotif_monitored_inode * mi;
+  int * blocks;
+  int count;
+  if (copy_from_user(&cmd, ucmd, sizeof(cmd)))
+    return -EFAULT;
+  if (cmd.cbn_max < 2 // a range needs 2 elements
+      || cmd.cbn_size < sizeof(cmd) + cmd.cbn_max * sizeof(int))
+    return -EINVAL;
+  if (sizeof(cmd) + cmd.cbn_max * sizeof(int) > MAX_REQUEST_SIZE)
+    cmd.cbn_max = (MAX_REQUEST_SIZE - sizeof(cmd)) / sizeof(int);
+  blocks = (int*)kmalloc(cmd.cbn_max * sizeof(int), GFP_KERNEL);
+  if (!blocks)
+    return -ENOMEM;
+  mi = get_mi_by_id(mp, cmd.cbn_file);
+  if (!mi) {
+    kfree(blocks);
+    return -EBADF;
+  }
+  count = encode_dblocks(&mi->frozen, blocks, cmd.cbn_max);
+  mutex_unlock(&mi->mi_mutex);
+  cmd.cbn_count = count;
+  if (copy_to_user(ucmd, &cmd, sizeof(cmd))
+      || copy_to_user(ucmd->cbn_blocks, blocks, count * sizeof(int))) {
+    mi = get_mi_by_id(mp, cmd.cbn_file);
+    if (mi) {
+      restore_blocks(&mi->frozen, blocks, count);
+      mutex_unlock(&mi->mi_mutex);
+    }
+    kfree(blocks);
+    return -EFAULT;
+  }
+  kfree(blocks);
+  return count;
+}
+
+/**
+ * encode_dblocks - moves ranges of the list into the array
+ * @blocks: single block numbers and pairs of -first, length (see CBN_IS_RANGE)
+ * @max: length of @blocks
+ *
+ * Returns the number of filled elements.
+ */
+static int encode_dblocks(struct list_head * dblocks, int * blocks, int max) {
+  struct cbnotif_dirty_block * db, * tmp;
+  int count = 0;
+  list_for_each_entry_safe(db, tmp, dblocks, next) {
+    if (!db->first && db->length > 1) { // -0 isn't a range
+      if (count == max)
+        break;
+      blocks[count++] = 0;
+      db->first = 1;
+      --db->length;
+    }
+    if (db->length == 1) {
+      if (count == max)
+        break;
+      blocks[count++] = db->first;
+    } else {
+      if (count + 2 > max)
         break;
+      blocks[count++] = -db->first;
+      blocks[count++] = db->length;
+    }
+    list_del(&db->next);
+    kfree(db);
+  }
+  return count;
+}
+
+/**
+ * mark_dirty - adds blocks covered by the write to the dirty list
+ * @mi: locked monitored inode
+ */
+static void mark_dirty(struct cbnotif_monitored_inode * mi, loff_t pos, size_t len) {
+  if (!len)
+    return;
+  if (pos < mi->extent_resume) // the reported part is dirty again
+    mi->extent_resume = 0;
+  count_dblocks(mi, add_range(&mi->dblocks, pos / mi->block_size,
+                               (pos + len - 1) / mi->block_size));
+}
+
+/**
+ * add_range - adds blocks first..last to the list of ranges
+ *
+ * The list is kept sorted and adjacent ranges are merged.
+ * If there is no memory for a new range then a neighbouring one
+ * is extended.
+ * Returns the number of blocks added to the list or -1 for overflow.
+ */
+static int add_range(struct list_head * dblocks, int first, int last) {
+  struct cbnotif_dirty_block * db, * tmp, * range = 0;
+  struct list_head * where = dblocks;
+  int merged = 0;
+  list_for_each_entry_safe(db, tmp, dblocks, next) {
+    if (db->first + db->length < first)
+      continue;
+    if (db->first > last + 1) {
+      where = &db->next;
+      break;
+    }
+    first = min(first, db->first);
+    last = max(last, db->first + db->length - 1);
+    merged += db->length;
+    if (range) {
+      list_del(&db->next);
+      kfree(db);
+    } else {
+      range = db;
+    }
+  }
+  if (!range) {
+    range = (struct cbnotif_dirty_block*)kmalloc(sizeof(*range), GFP_NOFS);
+    if (range) {
+      list_add_tail(&range->next, where);
+    } else {
+      if (where->prev != dblocks) {
+        range = list_entry(where->prev, struct cbnotif_dirty_block, next);
+        range->length = last - range->first + 1;
+      } else if (where != dblocks) {
+        range = list_entry(where, struct cbnotif_dirty_block, next);
+        range->length += range->first - first;
+        range->first = first;
       }
-      mutex_unlock(&_mi->mi_mutex);
-    }    
-    mutex_unlock(&_mp->mp_mutex);
-    if (found)
-        break;    
+      return -1;
+    }
   }
-  mutex_unlock(&mp_list_mutex);
-  spin_unlock(&file->f_path.dentry->d_lock);
-  printk(KERN_INFO "cbnotif dentry spin is unlocked; file = %p\n", file); 
-  spin_lock(&file->f_lock);
-  printk(KERN_INFO "cbnotif: file spin is unlocked; file = %p\n", file); 
-  if (found) {
-    printk(KERN_INFO "cbnotif: inode %p found for file %p\n", _mi->inode, file);
-    return _mi;    
-  }
-  printk(KERN_INFO "cbnotif: inode %p is not found for file %p\n", _mi->inode, file);  
-  return 0;
+  range->first = first;
+  range->length = last - first + 1;
+  return range->length - merged;
+}
+
+/**
+ * count_dblocks - updates num_dblocks by the result of add_range()
+ * @mi: locked monitored inode
+ */
+static void count_dblocks(struct cbnotif_monitored_inode * mi, int added) {
+  if (added < 0)
+    mi->num_dblocks = -1;
+  else if (mi->num_dblocks >= 0)
+    mi->num_dblocks += added;
+}
+
+/**
+ * count_blocks - returns number of blocks in the array encoded by encode_dblocks()
+ */
+static int count_blocks(const int * blocks, int count) {
+  int i = 0, n = 0;
+  while (i < count)
+    if (CBN_IS_RANGE(blocks[i])) {
+      n += CBN_RANGE_LENGTH(blocks[i]);
+      CBN_AFTER_RANGE(i);
+    } else {
+      ++n;
+      CBN_AFTER_BLOCK(i);
+    }
+  return n;
+}
+
+/**
+ * restore_blocks - returns blocks encoded by encode_dblocks() to the list
+ *
+ * Used when the blocks cannot be delivered to the user.
+ * Returns the result of add_range() summed over ranges.
+ */
+static int restore_blocks(struct list_head * dblocks, const int * blocks, int count) {
+  int i = 0, n = 0, added;
+  while (i < count) {
+    if (CBN_IS_RANGE(blocks[i])) {
+      added = add_range(dblocks, CBN_RANGE_START(blocks[i]),
+                        CBN_RANGE_START(blocks[i]) + CBN_RANGE_LENGTH(blocks[i]) - 1);
+      CBN_AFTER_RANGE(i);
+    } else {
+      added = add_range(dblocks, blocks[i], blocks[i]);
+      CBN_AFTER_BLOCK(i);
+    }
+    n = (n < 0 || added < 0) ? -1 : n + added;
+  }
+  return n;
+}
+
+/**
+ * track_write - extends the append stream or marks blocks dirty
+ * @mi: locked monitored inode
+ *
+ * A write reaching the end of file starts a stream; next writes right
+ * after it only advance append_next. Any other write flushes the stream
+ * into dblocks.
+ * Called after the write, so i_size already includes it.
+ */
+static void track_write(struct cbnotif_monitored_inode * mi, loff_t pos, size_t len) {
+  if (!len)
+    return;
+  if (mi->append_active && pos == mi->append_next) {
+    mi->append_next += len;
+    return;
+  }
+  append_flush(mi);
+  if (pos + len >= i_size_read(mi->inode)) {
+    mi->append_active = 1;
+    mi->append_start = pos;
+    mi->append_next = pos + len;
+    return;
+  }
+  mark_dirty(mi, pos, len);
+}
+
+/**
+ * append_flush - moves the append stream to dblocks as one range
+ * @mi: locked monitored inode
+ */
+static void append_flush(struct cbnotif_monitored_inode * mi) {
+  if (!mi->append_active)
+    return;
+  mi->append_active = 0;
+  mark_dirty(mi, mi->append_start, mi->append_next - mi->append_start);
 }
 
-/* static int cbnotif_find_inode(const char __user *dirname, struct path *path, unsigned flags) { */
-/* 	int error; */
+/**
+ * dirty_count - returns number of dirty blocks including the append stream
+ * @mi: locked monitored inode
+ *
+ * Blocks shared by the stream and dblocks are counted once.
+ * Returns -1 on overflow.
+ */
+static int dirty_count(struct cbnotif_monitored_inode * mi) {
+  struct cbnotif_dirty_block * db;
+  int first, last, count;
+  if (mi->num_dblocks < 0)
+    return -1;
+  if (!mi->append_active)
+    return mi->num_dblocks;
+  first = mi->append_start / mi->block_size;
+  last = (mi->append_next - 1) / mi->block_size;
+  count = mi->num_dblocks + last - first + 1;
+  // the stream is at the end of file, so overlapping ranges are at the tail
+  list_for_each_entry_reverse(db, &mi->dblocks, next) {
+    if (db->first + db->length <= first)
+      break;
+    if (db->first > last)
+      continue;
+    count -= min(last, db->first + db->length - 1) - max(first, db->first) + 1;
+  }
+  return count;
+}
+
+/**
+ * free_dblocks - frees all ranges of the list
+ */
+static void free_dblocks(struct list_head * dblocks) {
+  struct cbnotif_dirty_block * db, * tmp;
+  list_for_each_entry_safe(db, tmp, dblocks, next)
+    kfree(db);
+  INIT_LIST_HEAD(dblocks);
+}
+
+/**
+ * free_mi - frees the monitored inode removed from the process list
+ */
+static void free_mi(struct cbnotif_monitored_inode * mi) {
+  free_dblocks(&mi->dblocks);
+  free_dblocks(&mi->frozen);
+  free_heat(mi);
+  iput(mi->inode);
+  kfree(mi);
+}
+
+/**
+ * heat_bucket - returns index of the histogram bucket for the heat
+ */
+static int heat_bucket(int heat) {
+  return heat ? fls(heat) : 0;
+}
+
+/**
+ * heat_record - increments write counters of blocks covered by the write
+ * @mi: locked monitored inode
+ * @pos: offset of the write
+ * @len: bytes written
+ *
+ * Only touched chunks are decayed, so the work is bounded by
+ * the size of the write. Blocks a chunk cannot be allocated for
+ * are not counted.
+ */
+static void heat_record(struct cbnotif_monitored_inode * mi, loff_t pos, size_t len) {
+  unsigned long epoch;
+  int first, last, i;
+  if (!(mi->flags & CBN_MONITOR_HEAT) || !len)
+    return;
+  first = pos / mi->block_size;
+  last = (pos + len - 1) / mi->block_size;
+  if (first >= MAX_HEAT_BLOCKS)
+    return;
+  if (last >= MAX_HEAT_BLOCKS)
+    last = MAX_HEAT_BLOCKS - 1;
+  epoch = heat_epoch(mi);
+  for (i = first; i <= last; ++i) {
+    struct cbnotif_heat_chunk ** chunk = &mi->heat[i / HEAT_CHUNK];
+    if (!*chunk) {
+      *chunk = (struct cbnotif_heat_chunk*)kzalloc(sizeof(struct cbnotif_heat_chunk),
+                                                   GFP_NOFS | __GFP_NOWARN);
+      if (!*chunk) {
+        i += HEAT_CHUNK - 1 - i % HEAT_CHUNK;
+        continue;
+      }
+      (*chunk)->epoch = epoch;
+    }
+    if (i % HEAT_CHUNK == 0 || i == first)
+      heat_decay(*chunk, epoch);
+    if ((*chunk)->heat[i % HEAT_CHUNK] < 255)
+      ++(*chunk)->heat[i % HEAT_CHUNK];
+  }
+}
 
-/* 	error = user_path_at(AT_FDCWD, dirname, flags, path); */
-/* 	if (error) */
-/* 		return error; */
-/* 	/\* you can only watch an inode if you have read permissions on it *\/ */
-/* 	error = inode_permission(path->dentry->d_inode, MAY_READ); */
-/* 	if (error) */
-/* 		path_put(path); */
-/* 	return error; */
-/* } */
+/**
+ * heat_decay - halves counters of the chunk for each epoch passed
+ */
+static void heat_decay(struct cbnotif_heat_chunk * chunk, unsigned long epoch) {
+  unsigned long shift = epoch - chunk->epoch;
+  int i;
+  if (!shift)
+    return;
+  for (i = 0; i < HEAT_CHUNK; ++i)
+    chunk->heat[i] = shift < 8 ? chunk->heat[i] >> shift : 0;
+  chunk->epoch = epoch;
+}
+
+/**
+ * heat_epoch - returns the number of half-lives passed since monitoring start
+ * @mi: locked monitored inode
+ *
+ * The epoch never goes back, so a new heat_half_life applies
+ * only to the time after it is set.
+ */
+static unsigned long heat_epoch(struct cbnotif_monitored_inode * mi) {
+  unsigned long half_life = ACCESS_ONCE(heat_half_life) * HZ;
+  unsigned long passed;
+  if (!half_life) {
+    mi->heat_stamp = jiffies;
+    return mi->heat_epochs;
+  }
+  passed = (jiffies - mi->heat_stamp) / half_life;
+  mi->heat_epochs += passed;
+  mi->heat_stamp += passed * half_life;
+  return mi->heat_epochs;
+}
+
+/**
+ * free_heat - frees write counters of the file
+ */
+static void free_heat(struct cbnotif_monitored_inode * mi) {
+  int i;
+  if (!mi->heat)
+    return;
+  for (i = 0; i < HEAT_CHUNKS; ++i)
+    kfree(mi->heat[i]);
+  vfree(mi->heat);
+}
+
+/**
+ * account_write - records a completed write to the file for each process monitoring it
+ * @pos: offset the written bytes start at
+ * @len: bytes written
+ *
+ * Called after the original handler returns, so a block is marked
+ * dirty only after its data is in the page cache and a CBN_CUT
+ * taken in between sees the write in the next generation.
+ * Only mi_mutex of the file is taken; the inode is found in mi_hash.
+ */
+static void account_write(struct file * file, loff_t pos, size_t len) {
+  struct inode * inode = file->f_path.dentry->d_inode;
+  struct cbnotif_monitored_inode * mi;
+  struct hlist_node * node;
+  int idx;
+  if (!len)
+    return;
+  idx = srcu_read_lock(&mi_srcu);
+  hlist_for_each_entry_rcu(mi, node, &mi_hash[hash_ptr(inode, MI_HASH_BITS)], hash_node) {
+    if (mi->inode != inode)
+      continue;
+    mutex_lock(&mi->mi_mutex);
+    heat_record(mi, pos, len);
+    track_write(mi, pos, len);
+    check_query(mi);
+    mutex_unlock(&mi->mi_mutex);
+  }
+  srcu_read_unlock(&mi_srcu, idx);
+}
+
+static ssize_t write_inode(struct file * file, const char __user * data, size_t len, loff_t * ofs) {
+  struct cbnotif_hooked_fops orig;
+  ssize_t r;
+  if (get_orig_fops(file->f_op, &orig))
+    return -ENXIO;
+  r = orig.orig_write(file, data, len, ofs);
+  // *ofs is after the written bytes; for O_APPEND too
+  if (r > 0)
+    account_write(file, *ofs - r, r);
+  return r;
+}
+static ssize_t aio_write_inode(struct kiocb * kiocb, const struct iovec * iovec, unsigned long len, loff_t ofs) {
+  struct cbnotif_hooked_fops orig;
+  ssize_t r;
+  if (get_orig_fops(kiocb->ki_filp->f_op, &orig))
+    return -ENXIO;
+  r = orig.orig_aio_write(kiocb, iovec, len, ofs);
+  if (r > 0)
+    account_write(kiocb->ki_filp, kiocb->ki_pos - r, r);
+  else if (r == -EIOCBQUEUED) // ki_pos is the start of the queued direct write
+    account_write(kiocb->ki_filp, kiocb->ki_pos, iov_length(iovec, len));
+  return r;
+}
+
+static ssize_t sendpage_inode(struct file * file, struct page * page, int i1, size_t s, loff_t * ofs, int i2) {
+  struct cbnotif_hooked_fops orig;
+  ssize_t r;
+  if (get_orig_fops(file->f_op, &orig))
+    return -ENXIO;
+  r = orig.orig_sendpage(file, page, i1, s, ofs, i2);
+  if (r > 0)
+    account_write(file, *ofs - r, r);
+  return r;
+}
+
+static ssize_t splice_write_inode(struct pipe_inode_info * pipe, struct file * file,
+                                  loff_t * ofs, size_t s, unsigned int ui) {
+  struct cbnotif_hooked_fops orig;
+  ssize_t r;
+  if (get_orig_fops(file->f_op, &orig))
+    return -ENXIO;
+  r = orig.orig_splice_write(pipe, file, ofs, s, ui);
+  if (r > 0)
+    account_write(file, *ofs - r, r);
+  return r;
+}
+
+/**
+ * hook_fops - replaces write handlers of the table with hooks
+ * @fops: i_fop of a monitored inode
+ *
+ * Must be called with locked mp_list_mutex.
+ * Only present handlers are replaced. do_sync_write() isn't hooked
+ * because it calls aio_write which is hooked itself.
+ * Returns 0 if there is no memory.
+ */
+static struct cbnotif_hooked_fops * hook_fops(struct file_operations * fops) {
+  struct list_head * l;
+  struct cbnotif_hooked_fops * hf = 0;
+  list_for_each(l, &hooked_fops) {
+    if (((struct cbnotif_hooked_fops*)l)->fops == fops) {
+      hf = (struct cbnotif_hooked_fops*)l;
+      break;
+    }
+  }
+  if (!hf) {
+    hf = (struct cbnotif_hooked_fops*)kmalloc(sizeof(struct cbnotif_hooked_fops), GFP_KERNEL);
+    if (!hf)
+      return 0;
+    hf->fops = fops;
+    hf->users = 0;
+    hf->orig_write = fops->write;
+    hf->orig_aio_write = fops->aio_write;
+    hf->orig_sendpage = fops->sendpage;
+    hf->orig_splice_write = fops->splice_write;
+    list_add_rcu(&hf->next, &hooked_fops);
+  }
+  if (!hf->users++) {
+    if (fops->write && fops->write != do_sync_write)
+      fops->write = write_inode;
+    if (fops->aio_write)
+      fops->aio_write = aio_write_inode;
+    if (fops->sendpage)
+      fops->sendpage = sendpage_inode;
+    if (fops->splice_write)
+      fops->splice_write = splice_write_inode;
+  }
+  return hf;
+}
+
+/**
+ * unhook_fops - restores original handlers after the last user is gone
+ *
+ * Must be called with locked mp_list_mutex.
+ */
+static void unhook_fops(struct cbnotif_hooked_fops * hf) {
+  struct file_operations * fops = hf->fops;
+  if (--hf->users)
+    return;
+  fops->write = hf->orig_write;
+  fops->aio_write = hf->orig_aio_write;
+  fops->sendpage = hf->orig_sendpage;
+  fops->splice_write = hf->orig_splice_write;
+}
+
+/**
+ * get_orig_fops - copies original handlers of the hooked table
+ *
+ * Runs at every write to a hooked table, so no mutex is taken.
+ * Returns 0 or -ENXIO if the table has never been hooked.
+ */
+static int get_orig_fops(const struct file_operations * fops, struct cbnotif_hooked_fops * orig) {
+  struct cbnotif_hooked_fops * hf;
+  int r = -ENXIO;
+  rcu_read_lock();
+  list_for_each_entry_rcu(hf, &hooked_fops, next) {
+    if (hf->fops == fops) {
+      *orig = *hf;
+      r = 0;
+      break;
+    }
+  }
+  rcu_read_unlock();
+  return r;
+}
+
+/**
+ * get_mi_by_id - returns cbnotif_monitored_inode of the process
+ * @id: id of the file returned by CBN_MONITOR
+ *
+ * The inode is returned with locked mi_mutex.
+ * Returns 0 if the process doesn't monitor such file.
+ */
+static struct cbnotif_monitored_inode * get_mi_by_id(struct cbnotif_monitoring_process * mp, int id) {
+  struct cbnotif_monitored_inode * mi;
+  mutex_lock(&mp->mp_mutex);
+  mi = find_mi(mp, id);
+  if (mi)
+    mutex_lock(&mi->mi_mutex);
+  mutex_unlock(&mp->mp_mutex);
+  return mi;
+}
+
+/**
+ * find_mi - looks up the monitored file by id; mp_mutex must be held
+ *
+ * Returns 0 if the process doesn't monitor such file.
+ */
+static struct cbnotif_monitored_inode * find_mi(struct cbnotif_monitoring_process * mp, int id) {
+  if (id < 0) // idr_find() masks off the sign bit
+    return 0;
+  return (struct cbnotif_monitored_inode*)idr_find(&mp->mi_idr, id);
+}
+
+static int cbnotif_find_inode(const char __user *dirname, struct path *path, unsigned flags) {
+	int error;
+
+	error = user_path_at(AT_FDCWD, dirname, flags, path);
+	if (error)
+		return error;
+	/* you can only watch an inode if you have read permissions on it */
+	error = inode_permission(path->dentry->d_inode, MAY_READ);
+	if (error)
+		path_put(path);
+	return error;
+}
 
 
 module_init(cbnotif_init);
@@ -12,6 +12,35 @@
 // get list of changed blocks since previous call
 // - returns the number of changed blocks
 #define CBN_CHANGED_BLOCKS 3  
+// get physical extents of blocks changed since previous call
+// - returns the number of extents
+#define CBN_CHANGED_EXTENTS 4
+// get the hottest written extents and heat histogram of a file
+// monitored with CBN_MONITOR_HEAT - returns the number of extents
+#define CBN_HOT_EXTENTS 5
+// push changed blocks with their data into a pipe or socket
+// - returns the number of pushed records
+#define CBN_STREAM_BLOCKS 6
+// atomically freeze dirty blocks of a group of files
+// - returns 0 for ok
+#define CBN_CUT 7
+// get list of blocks frozen by CBN_CUT
+// - returns the number of elements in cbn_blocks
+#define CBN_FROZEN_BLOCKS 8
+// submit asynchronous change queries
+// - returns the number of accepted queries
+#define CBN_SUBMIT 9
+// get completed queries without blocking; poll() signals POLLIN for them
+// - returns the number of completions
+#define CBN_REAP 10
+// like CBN_MONITOR but takes cbn_monitor_flags
+// - returns id of file for ok
+#define CBN_MONITOR_FLAGS 11
+
+// flags of cbn_monitor_flags
+
+// keep decaying write-frequency counters per block
+#define CBN_MONITOR_HEAT 1
 
 // structures of operation argument that are passed
 // with optional argument of ioctl()
@@ -24,15 +53,165 @@ struct cbn_monitor {
   char cbn_path[1];
 };
 
+// cbn_monitor with flags; the layout of cbn_monitor is kept for old clients
+struct cbn_monitor_flags {
+  int cbn_size;  // cmd size
+  int cbn_block_size;
+  int cbn_flags; // CBN_MONITOR_*
+  char cbn_path[1];
+};
+
 // cbn_forget is int (id of the file)
 
+// reported blocks are removed from the set of dirty blocks.
+// cbn_file was added after the first version of the struct;
+// clients built with the old layout must be rebuilt.
 struct cbn_changed_blocks {
   int cbn_size;  // cmd size
+  int cbn_file;  // id of the file
   int cbn_max;   // length of cbn_blocks
   int cbn_count; // elements in cbn_blocks
   int cbn_blocks[0]; // block numbers or ranges
 };
 
+#define CBN_EXTENT_HOLE       1 // not allocated; reads as zeros. cbn_physical is 0
+#define CBN_EXTENT_UNWRITTEN  2 // allocated but reads as zeros; the device has garbage
+#define CBN_EXTENT_NOT_DIRECT 4 // data can't be read from the device at cbn_physical
+
+/**
+ * location of changed bytes of the file on the block device.
+ * offsets and length are in bytes.
+ */
+struct cbn_extent {
+  long long cbn_logical;  // offset in the file
+  long long cbn_physical; // offset on the block device
+  long long cbn_length;
+  int cbn_flags;          // CBN_EXTENT_*
+};
+
+/**
+ * the file's dirty data is flushed before mapping so
+ * the extents can be read with O_DIRECT from the device
+ * cbn_dev_major:cbn_dev_minor. offsets and lengths are multiples
+ * of the filesystem block size, so an extent may cover clean bytes
+ * around dirty blocks and the end of the last block after the end of file.
+ * adjacent extents are merged. holes and unwritten extents are reported with flags.
+ */
+struct cbn_changed_extents {
+  int cbn_size;  // cmd size
+  int cbn_file;  // id of the file
+  int cbn_max;   // length of cbn_extents
+  int cbn_count; // elements in cbn_extents
+  unsigned int cbn_dev_major;
+  unsigned int cbn_dev_minor;
+  struct cbn_extent cbn_extents[0];
+};
+
+/**
+ * heat is a saturating write counter of a block (0 - 255).
+ * it's halved every heat_half_life seconds (module parameter).
+ */
+struct cbn_hot_extent {
+  int cbn_first;  // number of the first block
+  int cbn_length; // in blocks
+  int cbn_heat;   // max heat of blocks in the extent
+};
+
+// bucket 0 - cold blocks up to the end of the file;
+// bucket i - heat in [2^(i-1), 2^i)
+#define CBN_HEAT_BUCKETS 9
+
+/**
+ * a hot extent is a run of adjacent blocks of the same heat bucket.
+ * cbn_extents are sorted by heat, hottest first.
+ */
+struct cbn_heat {
+  int cbn_size;  // cmd size
+  int cbn_file;  // id of the file
+  int cbn_max;   // length of cbn_extents
+  int cbn_count; // elements in cbn_extents
+  int cbn_histogram[CBN_HEAT_BUCKETS]; // number of blocks in each bucket
+  struct cbn_hot_extent cbn_extents[0];
+};
+
+/**
+ * the module writes a cbn_record followed by cbn_bytes of data
+ * for each range of changed blocks into cbn_dst_fd.
+ * data is spliced from the page cache of the file, not copied.
+ * cbn_dst_fd must be blocking. after an error the stream can end
+ * in the middle of a record, so cbn_dst_fd must be closed.
+ */
+struct cbn_stream {
+  int cbn_size;   // cmd size
+  int cbn_file;   // id of the file
+  int cbn_src_fd; // the monitored file opened for reading
+  int cbn_dst_fd; // pipe or socket
+};
+
+#define CBN_RECORD_MAGIC 0x72626e63 // "cnbr"
+
+struct cbn_record {
+  unsigned int cbn_magic;
+  int cbn_block_size;
+  int cbn_first;       // number of the first block
+  int cbn_length;      // in blocks
+  long long cbn_bytes; // data following the header; less than blocks at the end of file
+};
+
+/**
+ * dirty blocks of all files are swapped for empty sets at the same instant.
+ * fails with EBUSY if frozen blocks of a previous cut aren't drained
+ * with CBN_FROZEN_BLOCKS for any file of the group.
+ */
+struct cbn_cut {
+  int cbn_size;  // cmd size
+  int cbn_count; // elements in cbn_files
+  int cbn_files[0]; // ids of the files
+};
+
+// cbn_blocks are encoded like in cbn_changed_blocks
+struct cbn_frozen_blocks {
+  int cbn_size;  // cmd size
+  int cbn_file;  // id of the file
+  int cbn_max;   // length of cbn_blocks
+  int cbn_count; // elements in cbn_blocks
+  int cbn_blocks[0];
+};
+
+/**
+ * a query completes once the file has cbn_threshold dirty blocks
+ * (or overflowed). a file has at most one query; a new one replaces it.
+ */
+struct cbn_query {
+  long long cbn_cookie; // returned in the completion
+  int cbn_file;         // id of the file
+  int cbn_threshold;    // in blocks
+};
+
+/**
+ * queries are armed in order and their number isn't limited.
+ * CBN_SUBMIT returns the number of accepted queries; it stops at
+ * the first unknown file (-EBADF if that is the first query).
+ */
+struct cbn_submit {
+  int cbn_size;  // cmd size
+  int cbn_count; // elements in cbn_queries
+  struct cbn_query cbn_queries[0];
+};
+
+struct cbn_completion {
+  long long cbn_cookie;
+  int cbn_file;
+  int cbn_dirty; // number of dirty blocks; -1 for overflow
+};
+
+struct cbn_reap {
+  int cbn_size;  // cmd size
+  int cbn_max;   // length of cbn_completions
+  int cbn_count; // elements in cbn_completions
+  struct cbn_completion cbn_completions[0];
+};
+
 #define CBN_IS_RANGE(blk_num)  ((blk_num) < 0)
 #define CBN_RANGE_START(blk_num) (-(blk_num))
 #define CBN_RANGE_LENGTH(blk_num) (*(&(blk_num) + 1))
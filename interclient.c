@@ -7,6 +7,7 @@
 #include <sys/ioctl.h>
 #include <fcntl.h>
 #include <string.h>
+#include <poll.h>
 #include "cbnotif.h"
 
 /**
@@ -20,8 +21,15 @@ static void monitored_files_cmd(void);
 static void monitor_file_cmd(const char * args);
 static void forget_file_cmd(const char * args);
 static void get_changed_blocks_cmd(const char * args);
+static void get_changed_extents_cmd(const char * args);
+static void get_heat_cmd(const char * args);
+static void stream_blocks_cmd(const char * args);
+static void cut_cmd(const char * args);
+static void get_frozen_blocks_cmd(const char * args);
+static void watch_cmd(const char * args);
+static void wait_cmd(const char * args);
 static void modify_file_cmd(const char * args);
-static int pack_send_monitor(const char * file_path, int block_size);
+static int pack_send_monitor(const char * file_path, int block_size, int flags);
 static int insert_file_id(const char * file_path, ssize_t path_size, int file_id);
 static struct monitored_file * mf_lookup_by_id(int file_id);
 
@@ -83,6 +91,20 @@ static int process_command(char * command) {
     forget_file_cmd(command);
   } else if (!strcmp("changes", command_name)) {
     get_changed_blocks_cmd(command);
+  } else if (!strcmp("extents", command_name)) {
+    get_changed_extents_cmd(command);
+  } else if (!strcmp("heat", command_name)) {
+    get_heat_cmd(command);
+  } else if (!strcmp("stream", command_name)) {
+    stream_blocks_cmd(command);
+  } else if (!strcmp("cut", command_name)) {
+    cut_cmd(command);
+  } else if (!strcmp("frozen", command_name)) {
+    get_frozen_blocks_cmd(command);
+  } else if (!strcmp("watch", command_name)) {
+    watch_cmd(command);
+  } else if (!strcmp("wait", command_name)) {
+    wait_cmd(command);
   } else if (!strcmp("modify", command_name)) {
     modify_file_cmd(command);
   } else {
@@ -96,11 +118,27 @@ static void help_cmd(void) {
   printf("help                    - print this list\n"
          "exit                    - exit from the program\n"
          "list                    - print list of ids of monitored files\n"
-         "monitor <block-size> <path-to-file>\n"
+         "monitor <block-size> <path-to-file> [heat]\n"
          "                        - start monitoring of the file for changed blocks\n"
+         "                          heat - also count writes of blocks\n"
          "forget  <id-of-file>    - stop monioring of the file\n"
          "changes <id-of-file>    - get list changed blocks since previous call of changes or start monitoring\n"
          "                          it's a synchronous operation\n"
+         "extents <id-of-file>    - like changes but print physical extents of changed blocks\n"
+         "                          on the device for O_DIRECT reading\n"
+         "heat    <id-of-file> [number-of-extents]\n"
+         "                        - print heat histogram and hottest extents of the file\n"
+         "                          monitored with heat option\n"
+         "stream  <id-of-file> <path-to-replica>\n"
+         "                        - push changed blocks with data to ./receiver\n"
+         "                          which writes them into the replica file\n"
+         "cut     <id-of-file> ...\n"
+         "                        - freeze changed blocks of the files at the same instant\n"
+         "frozen  <id-of-file>    - get list of blocks frozen by cut\n"
+         "watch   <id-of-file> <number-of-blocks>\n"
+         "                        - submit asynchronous query which completes once\n"
+         "                          the file has the number of changed blocks\n"
+         "wait    [timeout-ms]    - wait for completed queries and print them\n"
          "modify  <id-of-file> <offset> <writing-word>\n"
          "                        - write <word> at the specified with given offset\n"
          );
@@ -126,7 +164,7 @@ static void monitored_files_cmd(void) {
 
 /**
  *  add new file to monitoring for changing its blocks
- *  @args has format "<block-size:long> <path-to-file>"
+ *  @args has format "<block-size:long> <path-to-file> [heat]"
  */
 static void monitor_file_cmd(const char * args) {
   if (number_monitored_files >= MAX_MONITORED_FILES) {
@@ -135,35 +173,56 @@ static void monitor_file_cmd(const char * args) {
   }
   {
     char file_path[256];
-    int  block_size;
-    if (2 != sscanf(args, "%d %256s\n", &block_size, file_path)) {
-      printf("invalid arguments. use: <block-size> <path-to-monitored-file>\n");
+    char option[8] = "";
+    int  block_size, flags = 0;
+    if (2 > sscanf(args, "%d %255s %7s\n", &block_size, file_path, option)) {
+      printf("invalid arguments. use: <block-size> <path-to-monitored-file> [heat]\n");
       return;
     }
-    pack_send_monitor(file_path, block_size);
+    if (!strcmp("heat", option)) {
+      flags |= CBN_MONITOR_HEAT;
+    } else if (*option) {
+      printf("unknown option '%s'\n", option);
+      return;
+    }
+    pack_send_monitor(file_path, block_size, flags);
   }  
 }
 
-static int pack_send_monitor(const char * file_path, int block_size) {
+static int pack_send_monitor(const char * file_path, int block_size, int flags) {
   ssize_t path_size = strlen(file_path);
-  ssize_t cmd_size = sizeof(struct cbn_monitor) + path_size;  
-  struct cbn_monitor * cmd = (struct cbn_monitor*)malloc(cmd_size);
-  if (!cmd) {
-    printf("no memory to send command\n");
-    return -1;
-  }
-  cmd->cbn_size = cmd_size;
-  cmd->cbn_block_size = block_size;
-  strcpy(cmd->cbn_path, file_path);      
-  {
-    int file_id = ioctl(dfile, CBN_MONITOR, cmd);
+  int file_id;
+  if (flags) {
+    ssize_t cmd_size = sizeof(struct cbn_monitor_flags) + path_size;
+    struct cbn_monitor_flags * cmd = (struct cbn_monitor_flags*)malloc(cmd_size);
+    if (!cmd) {
+      printf("no memory to send command\n");
+      return -1;
+    }
+    cmd->cbn_size = cmd_size;
+    cmd->cbn_block_size = block_size;
+    cmd->cbn_flags = flags;
+    strcpy(cmd->cbn_path, file_path);
+    file_id = ioctl(dfile, CBN_MONITOR_FLAGS, cmd);
     free(cmd);
-    if (file_id < 0) {
-      perror("cannot monitor file\n");
+  } else {
+    ssize_t cmd_size = sizeof(struct cbn_monitor) + path_size;  
+    struct cbn_monitor * cmd = (struct cbn_monitor*)malloc(cmd_size);
+    if (!cmd) {
+      printf("no memory to send command\n");
       return -1;
     }
-    return insert_file_id(file_path, path_size, file_id);
-  }  
+    cmd->cbn_size = cmd_size;
+    cmd->cbn_block_size = block_size;
+    strcpy(cmd->cbn_path, file_path);      
+    file_id = ioctl(dfile, CBN_MONITOR, cmd);
+    free(cmd);
+  }
+  if (file_id < 0) {
+    perror("cannot monitor file\n");
+    return -1;
+  }
+  return insert_file_id(file_path, path_size, file_id);
 }
 
 static int insert_file_id(const char * file_path, ssize_t path_size, int file_id) {
@@ -221,7 +280,7 @@ static void get_changed_blocks_cmd(const char * args) {
   int file_id, r;
   struct monitored_file * mf;
   int * blocks;
-  ssize_t cmd_size = sizeof(struct cbn_changed_blocks) + sizeof(int);
+  ssize_t cmd_size = sizeof(struct cbn_changed_blocks) + max_elems * sizeof(int);
   struct cbn_changed_blocks * cmd;
   if (sscanf(args, "%d", &file_id) != 1) {
     printf("id of monitored file expected\n");
@@ -238,6 +297,7 @@ static void get_changed_blocks_cmd(const char * args) {
     return;
   }
   cmd->cbn_size = cmd_size;
+  cmd->cbn_file = mf->mf_handler;
   cmd->cbn_max = max_elems;
   blocks = cmd->cbn_blocks;
   while ((r = ioctl(dfile, CBN_CHANGED_BLOCKS, cmd))) {
@@ -254,6 +314,306 @@ static void get_changed_blocks_cmd(const char * args) {
         printf(" %d", blocks[i]);
         ++i;
       }
+    printf("\n");
+  }
+  free(cmd);
+}
+
+/**
+ *  get list of physical extents of changed blocks.
+ *  format: <id-of-file>
+ */
+static void get_changed_extents_cmd(const char * args) {
+  const int max_elems = 100;
+  int file_id, r;
+  struct monitored_file * mf;
+  ssize_t cmd_size = sizeof(struct cbn_changed_extents) + max_elems * sizeof(struct cbn_extent);
+  struct cbn_changed_extents * cmd;
+  if (sscanf(args, "%d", &file_id) != 1) {
+    printf("id of monitored file expected\n");
+    return;
+  }
+  mf = mf_lookup_by_id(file_id);
+  if (!mf) {
+    printf("invalid file id %d\n", file_id);
+    return;
+  }
+  cmd = (struct cbn_changed_extents*)malloc(cmd_size);
+  if (!cmd) {
+    printf("no memory for buffer\n");
+    return;
+  }
+  cmd->cbn_size = cmd_size;
+  cmd->cbn_file = mf->mf_handler;
+  cmd->cbn_max = max_elems;
+  while ((r = ioctl(dfile, CBN_CHANGED_EXTENTS, cmd))) {
+    if (r < 0) {
+      perror("cannot get changed extents");
+      break;
+    }
+    printf("changed extents on device %u:%u (logical physical length):\n",
+           cmd->cbn_dev_major, cmd->cbn_dev_minor);
+    for (int i = 0; i < r; ++i)
+      printf(" %lld %lld %lld%s%s%s\n",
+             cmd->cbn_extents[i].cbn_logical,
+             cmd->cbn_extents[i].cbn_physical,
+             cmd->cbn_extents[i].cbn_length,
+             cmd->cbn_extents[i].cbn_flags & CBN_EXTENT_HOLE ? " hole" : "",
+             cmd->cbn_extents[i].cbn_flags & CBN_EXTENT_UNWRITTEN ? " unwritten" : "",
+             cmd->cbn_extents[i].cbn_flags & CBN_EXTENT_NOT_DIRECT ? " not-direct" : "");
+  }
+  free(cmd);
+}
+
+/**
+ *  get heat histogram and the hottest extents.
+ *  format: <id-of-file> [number-of-extents]
+ */
+static void get_heat_cmd(const char * args) {
+  int file_id, max_elems = 10, r;
+  struct monitored_file * mf;
+  ssize_t cmd_size;
+  struct cbn_heat * cmd;
+  if (sscanf(args, "%d %d", &file_id, &max_elems) < 1 || max_elems < 0) {
+    printf("invalid arguments. usage: <id-of-file> [number-of-extents]\n");
+    return;
+  }
+  mf = mf_lookup_by_id(file_id);
+  if (!mf) {
+    printf("invalid file id %d\n", file_id);
+    return;
+  }
+  cmd_size = sizeof(struct cbn_heat) + max_elems * sizeof(struct cbn_hot_extent);
+  cmd = (struct cbn_heat*)malloc(cmd_size);
+  if (!cmd) {
+    printf("no memory for buffer\n");
+    return;
+  }
+  cmd->cbn_size = cmd_size;
+  cmd->cbn_file = mf->mf_handler;
+  cmd->cbn_max = max_elems;
+  r = ioctl(dfile, CBN_HOT_EXTENTS, cmd);
+  if (r < 0) {
+    perror("cannot get heat");
+  } else {
+    printf("heat histogram (heat: blocks):\n");
+    printf(" %7d: %d\n", 0, cmd->cbn_histogram[0]);
+    for (int i = 1; i < CBN_HEAT_BUCKETS; ++i)
+      printf(" %3d-%3d: %d\n", 1 << (i - 1), (1 << i) - 1, cmd->cbn_histogram[i]);
+    printf("hot extents (first[length] heat):\n");
+    for (int i = 0; i < r; ++i)
+      printf(" %d[%d] %d\n", cmd->cbn_extents[i].cbn_first,
+             cmd->cbn_extents[i].cbn_length, cmd->cbn_extents[i].cbn_heat);
+  }
+  free(cmd);
+}
+
+/**
+ *  stream changed blocks into the replica through the receiver.
+ *  format: <id-of-file> <path-to-replica>
+ */
+static void stream_blocks_cmd(const char * args) {
+  int file_id, r;
+  char replica[256], receiver[300];
+  struct monitored_file * mf;
+  struct cbn_stream cmd;
+  FILE * receiver_in;
+  if (2 != sscanf(args, "%d %255s", &file_id, replica)) {
+    printf("invalid arguments. usage: <id-of-file> <path-to-replica>\n");
+    return;
+  }
+  mf = mf_lookup_by_id(file_id);
+  if (!mf) {
+    printf("invalid file id %d\n", file_id);
+    return;
+  }
+  cmd.cbn_size = sizeof(cmd);
+  cmd.cbn_file = mf->mf_handler;
+  cmd.cbn_src_fd = open(mf->mf_name, O_RDONLY);
+  if (cmd.cbn_src_fd < 0) {
+    perror("cannot open file\n");
+    return;
+  }
+  snprintf(receiver, sizeof(receiver), "./receiver '%s'", replica);
+  receiver_in = popen(receiver, "w");
+  if (!receiver_in) {
+    perror("cannot start receiver\n");
+    close(cmd.cbn_src_fd);
+    return;
+  }
+  cmd.cbn_dst_fd = fileno(receiver_in);
+  r = ioctl(dfile, CBN_STREAM_BLOCKS, &cmd);
+  if (r < 0) {
+    perror("cannot stream changed blocks");
+  } else {
+    printf("%d ranges are streamed\n", r);
+  }
+  pclose(receiver_in);
+  close(cmd.cbn_src_fd);
+}
+
+/**
+ *  freeze changed blocks of a group of files.
+ *  format: <id-of-file> ...
+ */
+static void cut_cmd(const char * args) {
+  struct cbn_cut * cmd;
+  ssize_t cmd_size = sizeof(struct cbn_cut) + MAX_MONITORED_FILES * sizeof(int);
+  int file_id, n;
+  cmd = (struct cbn_cut*)malloc(cmd_size);
+  if (!cmd) {
+    printf("no memory for buffer\n");
+    return;
+  }
+  cmd->cbn_size = cmd_size;
+  cmd->cbn_count = 0;
+  while (sscanf(args, "%d%n", &file_id, &n) == 1) {
+    struct monitored_file * mf = mf_lookup_by_id(file_id);
+    args += n;
+    if (!mf) {
+      printf("invalid file id %d\n", file_id);
+      free(cmd);
+      return;
+    }
+    if (cmd->cbn_count == MAX_MONITORED_FILES) {
+      printf("too many files\n");
+      free(cmd);
+      return;
+    }
+    cmd->cbn_files[cmd->cbn_count++] = mf->mf_handler;
+  }
+  if (!cmd->cbn_count) {
+    printf("ids of monitored files expected\n");
+  } else if (ioctl(dfile, CBN_CUT, cmd)) {
+    perror("cannot cut changed blocks");
+  } else {
+    printf("changed blocks of %d files are frozen\n", cmd->cbn_count);
+  }
+  free(cmd);
+}
+
+/**
+ *  get list of block numbers frozen by cut.
+ *  format: <id-of-file>
+ */
+static void get_frozen_blocks_cmd(const char * args) {
+  const int max_elems = 200;
+  int file_id, r;
+  struct monitored_file * mf;
+  ssize_t cmd_size = sizeof(struct cbn_frozen_blocks) + max_elems * sizeof(int);
+  struct cbn_frozen_blocks * cmd;
+  int * blocks;
+  if (sscanf(args, "%d", &file_id) != 1) {
+    printf("id of monitored file expected\n");
+    return;
+  }
+  mf = mf_lookup_by_id(file_id);
+  if (!mf) {
+    printf("invalid file id %d\n", file_id);
+    return;
+  }
+  cmd = (struct cbn_frozen_blocks*)malloc(cmd_size);
+  if (!cmd) {
+    printf("no memory for buffer\n");
+    return;
+  }
+  cmd->cbn_size = cmd_size;
+  cmd->cbn_file = mf->mf_handler;
+  cmd->cbn_max = max_elems;
+  blocks = cmd->cbn_blocks;
+  while ((r = ioctl(dfile, CBN_FROZEN_BLOCKS, cmd))) {
+    if (r < 0) {
+      perror("cannot get frozen block numbers");
+      break;
+    }
+    printf("frozen blocks:");
+    for (int i = 0; i < r;)
+      if (CBN_IS_RANGE(blocks[i])) {
+        printf(" %d[%d]", CBN_RANGE_START(blocks[i]), CBN_RANGE_LENGTH(blocks[i]));
+        CBN_AFTER_RANGE(i);
+      } else {
+        printf(" %d", blocks[i]);
+        ++i;
+      }
+    printf("\n");
+  }
+  free(cmd);
+}
+
+/**
+ *  submit asynchronous change query.
+ *  format: <id-of-file> <number-of-blocks>
+ */
+static void watch_cmd(const char * args) {
+  int file_id, threshold;
+  struct monitored_file * mf;
+  ssize_t cmd_size = sizeof(struct cbn_submit) + sizeof(struct cbn_query);
+  struct cbn_submit * cmd;
+  if (2 != sscanf(args, "%d %d", &file_id, &threshold)) {
+    printf("invalid arguments. usage: <id-of-file> <number-of-blocks>\n");
+    return;
+  }
+  mf = mf_lookup_by_id(file_id);
+  if (!mf) {
+    printf("invalid file id %d\n", file_id);
+    return;
+  }
+  cmd = (struct cbn_submit*)malloc(cmd_size);
+  if (!cmd) {
+    printf("no memory for buffer\n");
+    return;
+  }
+  cmd->cbn_size = cmd_size;
+  cmd->cbn_count = 1;
+  cmd->cbn_queries[0].cbn_cookie = file_id;
+  cmd->cbn_queries[0].cbn_file = mf->mf_handler;
+  cmd->cbn_queries[0].cbn_threshold = threshold;
+  if (ioctl(dfile, CBN_SUBMIT, cmd) < 0) {
+    perror("cannot submit query");
+  } else {
+    printf("query for file %d is submitted\n", file_id);
+  }
+  free(cmd);
+}
+
+/**
+ *  wait for completed queries.
+ *  format: [timeout-ms]
+ */
+static void wait_cmd(const char * args) {
+  const int max_elems = 32;
+  int timeout = 0, r;
+  struct pollfd pfd;
+  ssize_t cmd_size = sizeof(struct cbn_reap) + max_elems * sizeof(struct cbn_completion);
+  struct cbn_reap * cmd;
+  sscanf(args, "%d", &timeout);
+  pfd.fd = dfile;
+  pfd.events = POLLIN;
+  r = poll(&pfd, 1, timeout);
+  if (r < 0) {
+    perror("cannot poll");
+    return;
+  }
+  if (!r) {
+    printf("no completed queries\n");
+    return;
+  }
+  cmd = (struct cbn_reap*)malloc(cmd_size);
+  if (!cmd) {
+    printf("no memory for buffer\n");
+    return;
+  }
+  cmd->cbn_size = cmd_size;
+  cmd->cbn_max = max_elems;
+  while ((r = ioctl(dfile, CBN_REAP, cmd))) {
+    if (r < 0) {
+      perror("cannot reap completed queries");
+      break;
+    }
+    for (int i = 0; i < r; ++i)
+      printf("file %lld has %d changed blocks\n",
+             cmd->cbn_completions[i].cbn_cookie,
+             cmd->cbn_completions[i].cbn_dirty);
   }
   free(cmd);
 }
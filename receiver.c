@@ -0,0 +1,102 @@
+#include <stdio.h>
+#include <malloc.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include "cbnotif.h"
+
+/**
+ *  This is a local receiver of records streamed by cbnotif
+ *  kernel module with CBN_STREAM_BLOCKS command.
+ *  Reads records from stdin and writes their data
+ *  into the replica file at the same offsets.
+ */
+static int read_full(int fd, void * buf, ssize_t size);
+static int apply_record(int replica, const struct cbn_record * rec, char * buf, ssize_t buf_size);
+
+#define BUF_SIZE (1 << 20)
+
+int main(int argc, char ** argv) {
+  struct cbn_record rec;
+  char * buf;
+  int replica, r;
+  long records = 0;
+  long long bytes = 0;
+  if (argc != 2) {
+    fprintf(stderr, "usage: %s <path-to-replica-file>\n", argv[0]);
+    return -1;
+  }
+  replica = open(argv[1], O_WRONLY | O_CREAT, 0644);
+  if (replica < 0) {
+    perror("cannot open replica file");
+    return -1;
+  }
+  buf = (char*)malloc(BUF_SIZE);
+  if (!buf) {
+    fprintf(stderr, "no memory for buffer\n");
+    return -1;
+  }
+  while ((r = read_full(0, &rec, sizeof(rec))) > 0) {
+    if (rec.cbn_magic != CBN_RECORD_MAGIC) {
+      fprintf(stderr, "bad record magic %x after %ld records\n", rec.cbn_magic, records);
+      return -1;
+    }
+    if (apply_record(replica, &rec, buf, BUF_SIZE))
+      return -1;
+    ++records;
+    bytes += rec.cbn_bytes;
+  }
+  if (r < 0)
+    return -1;
+  printf("received %ld records, %lld bytes\n", records, bytes);
+  free(buf);
+  close(replica);
+  return 0;
+}
+
+/**
+ *  read exactly size bytes.
+ *  return 1 for ok, 0 for end of stream before the first byte
+ *  and -1 for error
+ */
+static int read_full(int fd, void * buf, ssize_t size) {
+  ssize_t done = 0;
+  while (done < size) {
+    ssize_t r = read(fd, (char*)buf + done, size - done);
+    if (r < 0) {
+      perror("cannot read stream");
+      return -1;
+    }
+    if (!r) {
+      if (done)
+        fprintf(stderr, "stream is cut in the middle of a record\n");
+      return done ? -1 : 0;
+    }
+    done += r;
+  }
+  return 1;
+}
+
+/**
+ *  copy data of the record from stdin to the replica.
+ *  return 0 for ok
+ */
+static int apply_record(int replica, const struct cbn_record * rec, char * buf, ssize_t buf_size) {
+  off_t pos = (off_t)rec->cbn_first * rec->cbn_block_size;
+  long long left = rec->cbn_bytes;
+  while (left > 0) {
+    ssize_t chunk = left < buf_size ? left : buf_size;
+    if (read_full(0, buf, chunk) <= 0) {
+      fprintf(stderr, "data of block %d is cut\n", rec->cbn_first);
+      return -1;
+    }
+    if (pwrite(replica, buf, chunk, pos) != chunk) {
+      perror("cannot write replica");
+      return -1;
+    }
+    pos += chunk;
+    left -= chunk;
+  }
+  return 0;
+}